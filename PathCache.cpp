@@ -3,9 +3,11 @@
 // found in the LICENSE file.
 
 #include "PathCache.h"
+#include "Timing.h"
 
 #include <sstream>
 #include <memory>
+#include <algorithm>
 
 #include <llvm/ADT/iterator_range.h>
 #include <llvm/IR/BasicBlock.h>
@@ -17,46 +19,61 @@
 
 using namespace llvm;
 
+std::string llvm::blockName(const BasicBlock *block) {
+  if (block->hasName()) return block->getName().str();
+  std::string name;
+  raw_string_ostream os(name);
+  block->printAsOperand(os, false);
+  return os.str();
+}
+
 ///////////////////////////////////////////////////////////////////////////
 // Graph algorithms
 
-template <class F>
-void forwardIterate(BasicBlock *src, F f) {
-  // We consider all exits from a function to loop back to the start
-  // edge, so we need to handle that unfortunate case.
-  if (isa<ReturnInst>(src->getTerminator())) {
-    BasicBlock *entry = &src->getParent()->getEntryBlock();
-    f(entry);
-  }
-  // Go search all the normal successors
-  for (auto i = succ_begin(src), e = succ_end(src); i != e; i++) {
-    f(*i);
+// We consider all exits from a function to loop back to the start
+// edge. Rather than discovering those edges on the fly (which, going
+// backwards from the entry block, means scanning the whole function
+// for returns), we build a view of the CFG with the virtual
+// return->entry edges added when we number the blocks.
+void PathCache::numberBlocks(Function *func) {
+  func_ = func;
+  blocks_.clear();
+  blockIDs_.clear();
+  for (auto & block : *func) {
+    blockIDs_[&block] = blocks_.size();
+    blocks_.push_back(&block);
   }
-}
-template <class F>
-void backwardIterate(BasicBlock *src, F f) {
-  // We consider all exits from a function to loop back to the start
-  // edge. This is the worst. Is there a better way than scanning
-  // them all?
-  if (src == &src->getParent()->getEntryBlock()) {
-    for (auto & block : *src->getParent()) {
-      if (isa<ReturnInst>(block.getTerminator())) {
-        f(&block);
-      }
+
+  BasicBlock *entry = &func->getEntryBlock();
+  succs_.assign(blocks_.size(), BlockList());
+  preds_.assign(blocks_.size(), BlockList());
+  BlockList &entryPreds = preds_[blockIDs_[entry]];
+  for (unsigned id = 0; id < blocks_.size(); id++) {
+    BasicBlock *block = blocks_[id];
+    if (isa<ReturnInst>(block->getTerminator())) {
+      succs_[id].push_back(entry);
+      entryPreds.push_back(block);
+    }
+    for (auto i = succ_begin(block), e = succ_end(block); i != e; i++) {
+      succs_[id].push_back(*i);
     }
   }
-  // Go search all the normal predecessors
-  for (auto i = pred_begin(src), e = pred_end(src); i != e; i++) {
-    f(*i);
+  // The real predecessors go after the virtual ones
+  for (unsigned id = 0; id < blocks_.size(); id++) {
+    BasicBlock *block = blocks_[id];
+    for (auto i = pred_begin(block), e = pred_end(block); i != e; i++) {
+      preds_[id].push_back(*i);
+    }
   }
 }
+
 template <class F>
-void graphIterate(BasicBlock *src, bool back, F f) {
-  if (back) {
-    backwardIterate(src, f);
-  } else {
-    forwardIterate(src, f);
-  }
+void PathCache::forwardIterate(BasicBlock *src, F f) {
+  for (auto *succ : succs_[blockID(src)]) f(succ);
+}
+template <class F>
+void PathCache::backwardIterate(BasicBlock *src, F f) {
+  for (auto *pred : preds_[blockID(src)]) f(pred);
 }
 
 // Code to find all simple paths between two basic blocks.
@@ -81,117 +98,474 @@ PathID PathCache::addToPath(BasicBlock *b, PathID id) {
   return newID;
 }
 
+// Paths are stored as cons cells, which is what we want for sharing
+// suffixes, but it means looking at a whole path requires walking
+// it. We flatten each path into the arena the first time someone
+// asks for it and hand out views of that from then on.
 Path PathCache::extractPath(PathID k) const {
-  Path path;
-  while (!isEmpty(k)) {
-    path.push_back(getHead(k));
-    k = getTail(k);
+  if (isEmpty(k)) return Path();
+  if (flatPaths_.size() <= (unsigned)k) flatPaths_.resize(entries_.size());
+  Path &flat = flatPaths_[k];
+  if (flat.data()) return flat;
+
+  unsigned length = 0;
+  for (PathID i = k; !isEmpty(i); i = getTail(i)) length++;
+  BasicBlock **blocks = pathArena_.Allocate<BasicBlock *>(length);
+  unsigned n = 0;
+  for (PathID i = k; !isEmpty(i); i = getTail(i)) blocks[n++] = getHead(i);
+  return flat = Path(blocks, length);
+}
+
+PathID PathCache::makePath(Path path) {
+  PathID id = kEmptyPath;
+  for (auto i = path.rbegin(), e = path.rend(); i != e; ++i) {
+    id = addToPath(*i, id);
   }
-  return path;
+  return id;
 }
 
-PathList PathCache::findAllSimplePaths(SkipSet *grey,
+// We do a depth first search with an explicit stack, since CFGs can
+// be deep enough that recursing would be a problem. The stack holds
+// the current path, which is what we cons up whenever we hit dst.
+//
+// We can't really do any sort of memoization, since in a cyclic
+// graph the possible simple paths depend not just on what node we
+// are on, but our previous path (to avoid looping).
+PathList PathCache::findAllSimplePaths(BlockSet *grey,
                                        BasicBlock *src, BasicBlock *dst,
                                        bool allowSelfCycle) {
   PathList paths;
+  auto foundPath = [&] () {
+    if (pathBudget_ && ++pathsFound_ > pathBudget_) {
+      overBudget_ = true;
+      return false;
+    }
+    return true;
+  };
   if (src == dst && !allowSelfCycle) {
-    PathID path = addToPath(dst, kEmptyPath);
-    paths.push_back(path);
+    if (foundPath()) paths.push_back(addToPath(dst, kEmptyPath));
     return paths;
   }
-  if (grey->count(src)) return paths;
 
-  grey->insert(src);
+  struct Frame {
+    BasicBlock *block;
+    unsigned id;
+    unsigned nextSucc;
+  };
+  SmallVector<Frame, 16> stack;
+  auto visit = [&] (BasicBlock *block) {
+    unsigned id = blockID(block);
+    if (grey->test(id)) return;
+    // Dead ends cost time too, so also bound the total amount of
+    // searching we do.
+    if (pathBudget_ && ++pathSteps_ / numBlocks() > pathBudget_) {
+      overBudget_ = true;
+      return;
+    }
+    grey->set(id);
+    stack.push_back(Frame{block, id, 0});
+  };
 
-  forwardIterate(src, [&] (BasicBlock *succ) {
-    PathList subpaths = findAllSimplePaths(grey, succ, dst, false);
-    std::move(subpaths.begin(), subpaths.end(), std::back_inserter(paths));
-  });
+  visit(src);
+  while (!stack.empty() && !overBudget_) {
+    Frame &top = stack.back();
+    const BlockList &succs = succs_[top.id];
+    if (top.nextSucc == succs.size()) {
+      // Remove it from the set of things we've seen. We might come
+      // through here again.
+      grey->reset(top.id);
+      stack.pop_back();
+      continue;
+    }
+
+    BasicBlock *succ = succs[top.nextSucc++];
+    if (succ == dst) {
+      if (!foundPath()) break;
+      PathID path = addToPath(dst, kEmptyPath);
+      for (auto i = stack.rbegin(), e = stack.rend(); i != e; ++i) {
+        path = addToPath(i->block, path);
+      }
+      paths.push_back(path);
+    } else {
+      visit(succ);
+    }
+  }
 
-  // Add our step to all of the vectors
-  for (auto & path : paths) {
-    path = addToPath(src, path);
+  if (overBudget_) {
+    for (auto & frame : stack) grey->reset(frame.id);
+    paths.clear();
   }
+  return paths;
+}
 
-  // Remove it from the set of things we've seen. We might come
-  // through here again.
-  // We can't really do any sort of memoization, since in a cyclic
-  // graph the possible simple paths depend not just on what node we
-  // are on, but our previous path (to avoid looping).
-  grey->erase(src);
+unsigned PathCache::blockID(BasicBlock *block) {
+  if (func_ != block->getParent()) numberBlocks(block->getParent());
+  auto id = blockIDs_.find(block);
+  assert(id != blockIDs_.end() && "CFG changed under the PathCache");
+  return id->second;
+}
 
-  return paths;
+PathCache::BlockSet PathCache::emptyBlockSet(BasicBlock *block) {
+  blockID(block); // make sure the function is numbered
+  return BlockSet(numBlocks());
 }
 
 template <class Post>
-void findAllReachableDFS(PathCache::SkipSet *grey,
-                         BasicBlock *src,
-                         bool backwards,
-                         Post post) {
+void PathCache::findAllReachableDFS(BlockSet *grey,
+                                    BasicBlock *src,
+                                    bool backwards,
+                                    Post post) {
+  unsigned id = blockID(src);
+  if (grey->test(id)) return;
 
-  if (grey->count(src)) return;
-
-  grey->insert(src);
-  graphIterate(src, backwards, [&] (BasicBlock *succ) {
-    findAllReachableDFS(grey, succ, backwards, post);
-  });
-  post(src);
+  // Same explicit stack trick as in findAllSimplePaths
+  SmallVector<std::pair<unsigned, unsigned>, 16> stack;
+  grey->set(id);
+  stack.push_back(std::make_pair(id, 0));
+  while (!stack.empty()) {
+    unsigned cur = stack.back().first;
+    const BlockList &next = backwards ? preds_[cur] : succs_[cur];
+    if (stack.back().second == next.size()) {
+      stack.pop_back();
+      post(blocks_[cur]);
+      continue;
+    }
+    unsigned succ = blockID(next[stack.back().second++]);
+    if (grey->test(succ)) continue;
+    grey->set(succ);
+    stack.push_back(std::make_pair(succ, 0));
+  }
 }
 
 // Find SCCs using Kosaraju's Algorithm
-PathCache::SCCMap PathCache::findSCCs(SkipSet *skip, Function *func) {
-  PathCache::SkipSet grey = *skip;
+PathCache::SCCIndex PathCache::findSCCs(BasicBlock *bindSite,
+                                        Function *func) {
+  BlockSet skip = emptyBlockSet(&func->getEntryBlock());
+  if (bindSite) skip.set(blockID(bindSite));
+  BlockSet grey = skip;
 
   // Generating an ordering to traverse.
   std::vector<BasicBlock *> order;
+  order.reserve(numBlocks());
   auto post = [&](BasicBlock *node) { order.push_back(node); };
   for (auto & block : *func) {
     findAllReachableDFS(&grey, &block, false, post);
   }
 
   // Use that ordering a DFS over the reverse graph to compute SCCs.
-  grey = *skip;
-  SCCMap sccs;
+  grey = skip;
+  SCCIndex sccs;
+  sccs.sccOf.resize(numBlocks());
   for (auto * block : make_range(order.rbegin(), order.rend())) {
-    if (grey.count(block)) continue;
+    if (grey.test(blockID(block))) continue;
 
+    unsigned scc = sccs.canonical.size();
+    sccs.canonical.push_back(block);
     findAllReachableDFS(&grey, block, true,
                         [&] (BasicBlock *node) {
-      sccs[node] = block;
+      sccs.sccOf[blockID(node)] = scc;
     });
+  }
 
-    /*
-    for (BasicBlock * block : *set) {
-      errs() << block->getName() << ", ";
-    }
-    errs() << "\n";
-    */
+  // Skipped blocks go in their own SCC at the end
+  unsigned skipSCC = sccs.canonical.size();
+  sccs.canonical.push_back(nullptr);
+  for (int i = skip.find_first(); i >= 0; i = skip.find_next(i)) {
+    sccs.sccOf[i] = skipSCC;
   }
 
   return sccs;
 }
 
-PathCache::SCCMap PathCache::findSCCs(BasicBlock *bindSite, Function *func) {
-  SkipSet skip;
-  if (bindSite) skip.insert(bindSite);
-  return findSCCs(&skip, func);
+const PathCache::SCCIndex &PathCache::findSCCsCached(
+    BasicBlock *bindSite, Function *func) {
+  auto entry = sccCache_.find(bindSite);
+  if (entry != sccCache_.end()) return entry->second;
+  SCCIndex sccs = findSCCs(bindSite, func);
+  return sccCache_[bindSite] = std::move(sccs);
 }
 
-PathCache::SCCMap *PathCache::findSCCsCached(
-    BasicBlock *bindSite, Function *func) {
-  if (sccCache_.count(bindSite)) {
-    return &sccCache_[bindSite];
+BitVector PathCache::pathSCCs(BasicBlock *bindSite, PathID pathid) {
+  if (isEmpty(pathid)) return BitVector();
+  const SCCIndex &sccs =
+    findSCCsCached(bindSite, getHead(pathid)->getParent());
+  BitVector reachable(sccs.numSCCs());
+  for (PathID k = pathid; !isEmpty(k); k = getTail(k)) {
+    reachable.set(sccs.sccOf[blockID(getHead(k))]);
+  }
+  return reachable;
+}
+
+BitVector PathCache::regionSCCs(BasicBlock *bindSite,
+                                const PathRegion &region) {
+  const SCCIndex &sccs =
+    findSCCsCached(bindSite, region.src->getParent());
+  BitVector reachable(sccs.numSCCs());
+  reachable.set(sccs.sccOf[blockID(region.src)]);
+  reachable.set(sccs.sccOf[blockID(region.dst)]);
+  for (int i = region.interior.find_first(); i >= 0;
+       i = region.interior.find_next(i)) {
+    reachable.set(sccs.sccOf[i]);
+  }
+  return reachable;
+}
+
+// Path regions. A block is in the interior of a region if it can be
+// reached from src and can reach dst without passing through the
+// endpoints or the skip block. The endpoints are handled specially
+// because simple paths can't revisit them, and so that src == dst
+// gives us the cycles through src.
+template <class Next>
+void PathCache::regionSearch(BasicBlock *from, BasicBlock *to,
+                             BasicBlock *skip, BlockSet *seen, Next next) {
+  *seen = emptyBlockSet(from);
+  std::vector<BasicBlock *> worklist{from};
+  while (!worklist.empty()) {
+    BasicBlock *block = worklist.back();
+    worklist.pop_back();
+    next(block, [&] (BasicBlock *succ) {
+      if (succ == from || succ == to || succ == skip) return;
+      unsigned id = blockID(succ);
+      if (seen->test(id)) return;
+      seen->set(id);
+      worklist.push_back(succ);
+    });
+  }
+}
+
+PathCache::PathRegion PathCache::findPathRegion(BasicBlock *skip,
+                                                BasicBlock *src,
+                                                BasicBlock *dst) {
+  PathRegion region;
+  region.src = src;
+  region.dst = dst;
+  region.interior = emptyBlockSet(src);
+  if (src == skip) return region;
+
+  BlockSet forward, backward;
+  regionSearch(src, dst, skip, &forward,
+               [&] (BasicBlock *b, std::function<void (BasicBlock *)> f) {
+                 forwardIterate(b, f); });
+  regionSearch(dst, src, skip, &backward,
+               [&] (BasicBlock *b, std::function<void (BasicBlock *)> f) {
+                 backwardIterate(b, f); });
+  region.interior = forward;
+  region.interior &= backward;
+
+  SmallPtrSet<BasicBlock *, 4> succs;
+  auto addEdges = [&] (BasicBlock *block) {
+    succs.clear();
+    forwardIterate(block, [&] (BasicBlock *succ) {
+      if ((succ == dst || region.interior.test(blockID(succ))) &&
+          succs.insert(succ).second) {
+        region.edges.push_back(std::make_pair(block, succ));
+      }
+    });
+  };
+  addEdges(src);
+  for (int i = region.interior.find_first(); i >= 0;
+       i = region.interior.find_next(i)) {
+    addEdges(blockAt(i));
+  }
+
+  return region;
+}
+
+PathCache::PathRegion PathCache::restrictRegion(const PathRegion &region,
+                                                EdgePred isCut) {
+  // Build adjacency lists out of the uncut edges, indexed by block ID
+  blockID(region.src);
+  std::vector<bool> cut(region.edges.size());
+  std::vector<SmallVector<BasicBlock *, 2>> succs(numBlocks()),
+    preds(numBlocks());
+  for (unsigned i = 0; i < region.edges.size(); i++) {
+    auto & edge = region.edges[i];
+    cut[i] = isCut(edge.first, edge.second);
+    if (cut[i]) continue;
+    succs[blockID(edge.first)].push_back(edge.second);
+    preds[blockID(edge.second)].push_back(edge.first);
+  }
+
+  BlockSet forward, backward;
+  regionSearch(region.src, region.dst, nullptr, &forward,
+               [&] (BasicBlock *b, std::function<void (BasicBlock *)> f) {
+                 for (auto *succ : succs[blockID(b)]) f(succ); });
+  regionSearch(region.dst, region.src, nullptr, &backward,
+               [&] (BasicBlock *b, std::function<void (BasicBlock *)> f) {
+                 for (auto *pred : preds[blockID(b)]) f(pred); });
+
+  PathRegion restricted;
+  restricted.src = region.src;
+  restricted.dst = region.dst;
+  restricted.interior.resize(region.interior.size());
+  for (unsigned i = 0; i < region.edges.size(); i++) {
+    BasicBlock *from = region.edges[i].first, *to = region.edges[i].second;
+    if (cut[i]) continue;
+    unsigned fromID = blockID(from), toID = blockID(to);
+    if (from != region.src && !forward.test(fromID)) continue;
+    if (to != region.dst && !backward.test(toID)) continue;
+    restricted.edges.push_back(region.edges[i]);
+    if (from != region.src) restricted.interior.set(fromID);
+    if (to != region.dst) restricted.interior.set(toID);
+  }
+
+  return restricted;
+}
+
+// Edmonds-Karp. Regions are small and the capacities are execution
+// frequencies, so nothing fancier seems worth it.
+//
+// The flow network has a node for each interior block plus separate
+// source and sink nodes for src and dst, which keeps things working
+// when src == dst and we are cutting cycles.
+bool PathCache::findMinCut(const PathRegion &region, EdgeCost capacity,
+                           std::vector<RegionEdge> *cut) {
+  cut->clear();
+  if (region.empty()) return true;
+
+  const int kSource = 0, kSink = 1;
+  blockID(region.src); // make sure the function is numbered
+  std::vector<int> nodeOf(numBlocks(), -1);
+  int numNodes = 2;
+  auto node = [&] (BasicBlock *block, bool isFrom) {
+    if (isFrom && block == region.src) return kSource;
+    if (!isFrom && block == region.dst) return kSink;
+    int &n = nodeOf[blockID(block)];
+    if (n < 0) n = numNodes++;
+    return n;
+  };
+
+  // Arcs come in pairs, so the reverse of arc a is a^1.
+  typedef long long Flow;
+  std::vector<int> arcTo;
+  std::vector<Flow> residual;
+  std::vector<int> edgeArc;
+  std::vector<int> uncuttable;
+  Flow total = 0;
+  for (auto & edge : region.edges) {
+    int from = node(edge.first, true), to = node(edge.second, false);
+    int cap = capacity(edge.first, edge.second);
+    if (cap < 0) {
+      uncuttable.push_back(arcTo.size());
+    } else {
+      total += cap;
+    }
+    edgeArc.push_back(arcTo.size());
+    arcTo.push_back(to); residual.push_back(cap);
+    arcTo.push_back(from); residual.push_back(0);
+  }
+  // Anything bigger than every finite cut works as infinity
+  const Flow kInfinity = total + 1;
+  for (int arc : uncuttable) residual[arc] = kInfinity;
+
+  std::vector<SmallVector<int, 4>> arcs(numNodes);
+  for (unsigned arc = 0; arc < arcTo.size(); arc++) {
+    arcs[arcTo[arc ^ 1]].push_back(arc);
+  }
+
+  // Push flow along shortest augmenting paths until there aren't any
+  Flow flow = 0;
+  std::vector<int> via(numNodes);
+  while (flow < kInfinity) {
+    std::fill(via.begin(), via.end(), -1);
+    std::vector<int> queue{kSource};
+    via[kSource] = -2;
+    for (unsigned i = 0; i < queue.size() && via[kSink] == -1; i++) {
+      for (int arc : arcs[queue[i]]) {
+        if (residual[arc] > 0 && via[arcTo[arc]] == -1) {
+          via[arcTo[arc]] = arc;
+          queue.push_back(arcTo[arc]);
+        }
+      }
+    }
+    if (via[kSink] == -1) break;
+
+    Flow push = kInfinity;
+    for (int n = kSink; n != kSource; n = arcTo[via[n] ^ 1]) {
+      push = std::min(push, residual[via[n]]);
+    }
+    for (int n = kSink; n != kSource; n = arcTo[via[n] ^ 1]) {
+      residual[via[n]] -= push;
+      residual[via[n] ^ 1] += push;
+    }
+    flow += push;
+  }
+  if (flow >= kInfinity) return false;
+
+  // The nodes that can still reach the sink; the cut is the edges
+  // going into them.
+  std::vector<bool> nearSink(numNodes);
+  std::vector<int> queue{kSink};
+  nearSink[kSink] = true;
+  for (unsigned i = 0; i < queue.size(); i++) {
+    for (int arc : arcs[queue[i]]) {
+      int pred = arcTo[arc];
+      if (residual[arc ^ 1] > 0 && !nearSink[pred]) {
+        nearSink[pred] = true;
+        queue.push_back(pred);
+      }
+    }
+  }
+  for (unsigned i = 0; i < region.edges.size(); i++) {
+    int arc = edgeArc[i];
+    if (!nearSink[arcTo[arc ^ 1]] && nearSink[arcTo[arc]]) {
+      cut->push_back(region.edges[i]);
+    }
   }
-  sccCache_[bindSite] = findSCCs(bindSite, func);
-  return &sccCache_[bindSite];
+
+  return true;
 }
 
 PathList PathCache::findAllSimplePaths(BasicBlock *src, BasicBlock *dst,
                                        bool allowSelfCycle) {
-  SkipSet grey;
+  BlockSet grey = emptyBlockSet(src);
+  resetBudget();
   return findAllSimplePaths(&grey, src, dst, allowSelfCycle);
 }
 
+const PathCache::PathQuery &PathCache::findAllSimplePathsCached(
+    BasicBlock *bindSite, BasicBlock *src, BasicBlock *dst,
+    bool allowSelfCycle) {
+  PathQueryKey key(bindSite, src, dst, allowSelfCycle);
+  auto entry = pathQueries_.find(key);
+  if (entry != pathQueries_.end()) {
+    pathStats_.hits++;
+    return entry->second;
+  }
+  pathStats_.misses++;
+  PhaseTimer timer(queryTime_);
+
+  BlockSet grey = emptyBlockSet(src);
+  if (bindSite) grey.set(blockID(bindSite));
+  resetBudget();
+  PathQuery &query = pathQueries_[key];
+  query.paths = findAllSimplePaths(&grey, src, dst, allowSelfCycle);
+  query.overBudget = overBudget_;
+  pathsEnumerated_ += query.paths.size();
+  return query;
+}
+
+bool PathCache::exceedsPathBudget(BasicBlock *bindSite,
+                                  BasicBlock *src, BasicBlock *dst,
+                                  bool allowSelfCycle) {
+  return findAllSimplePathsCached(bindSite, src, dst, allowSelfCycle)
+    .overBudget;
+}
+
+const PathCache::PathRegion &PathCache::findPathRegionCached(
+    BasicBlock *bindSite, BasicBlock *src, BasicBlock *dst) {
+  PathQueryKey key(bindSite, src, dst, true);
+  auto entry = regionQueries_.find(key);
+  if (entry != regionQueries_.end()) {
+    regionStats_.hits++;
+    return entry->second;
+  }
+  regionStats_.misses++;
+  PhaseTimer timer(queryTime_);
+
+  return regionQueries_[key] = findPathRegion(bindSite, src, dst);
+}
+
 ////
 std::string PathCache::formatPath(PathID pathid) const {
   std::ostringstream buffer;
@@ -200,7 +574,7 @@ std::string PathCache::formatPath(PathID pathid) const {
   for (auto block : path) {
     if (!first) buffer << "->";
     first = false;
-    buffer << block->getName().str();
+    buffer << blockName(block);
   }
   return buffer.str();
 }
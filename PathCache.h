@@ -7,39 +7,145 @@
 
 #include <llvm/IR/BasicBlock.h>
 #include <llvm/ADT/SmallVector.h>
+#include <llvm/ADT/ArrayRef.h>
 #include <llvm/ADT/DenseMap.h>
 #include <llvm/ADT/SmallPtrSet.h>
+#include <llvm/ADT/BitVector.h>
+#include <llvm/Support/Allocator.h>
+
+#include <functional>
+#include <map>
+#include <tuple>
 
 
 namespace llvm {
 
 typedef int PathID;
 typedef SmallVector<PathID, 2> PathList;
-typedef std::vector<BasicBlock *> Path;
+typedef ArrayRef<BasicBlock *> Path;
+
+// A name for a block, for debugging output. Nothing depends on blocks
+// having names (the context might be discarding them), so unnamed
+// blocks get the number they would be printed with.
+std::string blockName(const BasicBlock *block);
 
 // Structure to manage path information, which we do in order to
 // provide small unique path identifiers.
 class PathCache {
 public:
-  void clear() { entries_.clear(); cache_.clear(); }
+  void clear() {
+    entries_.clear(); cache_.clear(); sccCache_.clear();
+    flatPaths_.clear(); pathArena_.Reset();
+    pathQueries_.clear(); regionQueries_.clear();
+    pathStats_ = regionStats_ = QueryStats();
+    pathsEnumerated_ = 0;
+    queryTime_ = 0;
+    func_ = nullptr; blocks_.clear(); blockIDs_.clear();
+    succs_.clear(); preds_.clear();
+  }
   PathList findAllSimplePaths(BasicBlock *src, BasicBlock *dst,
                               bool allowSelfCycle = true);
-  typedef SmallPtrSet<BasicBlock *, 8> SkipSet;
-  PathList findAllSimplePaths(SkipSet *grey, BasicBlock *src, BasicBlock *dst,
-                              bool allowSelfCycle = true);
-
-  // this isn't really path related but...  We calculate SCCs as a map
-  // from blocks to a "canonical" element of the SCC. This can be
-  // turned into a map from blocks to SCC sets in linear time but
-  // since we only need to check if blocks are in the same SCC we
-  // don't need to.
-  typedef DenseMap<BasicBlock *, BasicBlock *> SCCMap;
-  SCCMap findSCCs(SkipSet *skip, Function *func);
-  SCCMap findSCCs(BasicBlock *bindSite, Function *func);
-  SCCMap *findSCCsCached(BasicBlock *bindSite, Function *func);
-  SkipSet pathSCCs(BasicBlock *bindSite, PathID pathid);
-
+  // Blocks get numbered densely the first time we look at a function,
+  // so that sets of blocks can be bitvectors instead of hash sets.
+  // The CFG mustn't change afterwards without a clear().
+  typedef BitVector BlockSet;
+  unsigned blockID(BasicBlock *block);
+  BasicBlock *blockAt(unsigned id) const { return blocks_[id]; }
+  unsigned numBlocks() const { return blocks_.size(); }
+
+  // this isn't really path related but...  We calculate SCCs as a
+  // dense SCC number for each block. Since we only need to check if
+  // blocks are in the same SCC, we never build the sets
+  // themselves. Skipped blocks all get put in one extra SCC.
+  struct SCCIndex {
+    std::vector<unsigned> sccOf; // by block ID
+    std::vector<BasicBlock *> canonical; // by SCC number, for debugging
+    unsigned numSCCs() const { return canonical.size(); }
+  };
+  SCCIndex findSCCs(BasicBlock *bindSite, Function *func);
+  const SCCIndex &findSCCsCached(BasicBlock *bindSite, Function *func);
+  // The set of SCCs touched by a path, as a bitvector of SCC numbers.
+  BitVector pathSCCs(BasicBlock *bindSite, PathID pathid);
+
+  // The blocks along a path, valid until clear().
   Path extractPath(PathID k) const;
+  // And back again.
+  PathID makePath(Path path);
+
+  // A compressed representation of all of the simple paths from src
+  // to dst that don't pass through skip: the set of CFG edges that
+  // appear on at least one of them. The number of simple paths can be
+  // exponential in the size of the CFG, but the region is linear, and
+  // questions of the form "is every path cut by something" can be
+  // answered by reachability over it instead of by enumeration.
+  // (This works because there is a path avoiding some set of edges
+  // iff there is a *simple* path avoiding them.)
+  typedef std::pair<BasicBlock *, BasicBlock *> RegionEdge;
+  struct PathRegion {
+    BasicBlock *src{nullptr};
+    BasicBlock *dst{nullptr};
+    // The blocks on some path other than the endpoints.
+    BlockSet interior;
+    std::vector<RegionEdge> edges;
+
+    bool empty() const { return edges.empty(); }
+  };
+  typedef std::function<bool (BasicBlock *src, BasicBlock *dst)> EdgePred;
+
+  PathRegion findPathRegion(BasicBlock *skip,
+                            BasicBlock *src, BasicBlock *dst);
+  // Restrict a region to the paths that don't use any edge that isCut.
+  // If the result is empty, every path in the region is cut.
+  PathRegion restrictRegion(const PathRegion &region, EdgePred isCut);
+  BitVector regionSCCs(BasicBlock *bindSite, const PathRegion &region);
+
+  // Find a cheapest set of edges that cuts every path in a region,
+  // using max-flow. capacity gives the cost of cutting an edge, or -1
+  // if it can't be cut. Of the minimum cuts, we pick the one closest
+  // to dst. Returns false if there is no cut at all.
+  typedef std::function<int (BasicBlock *src, BasicBlock *dst)> EdgeCost;
+  bool findMinCut(const PathRegion &region, EdgeCost capacity,
+                  std::vector<RegionEdge> *cut);
+
+  // Memoized versions of the path queries, avoiding bindSite. The same
+  // queries get made over and over while analyzing a function (for
+  // each edge, its self edge, and each sort of cut), and the CFG
+  // doesn't change while we do it. The returned references stay valid
+  // until clear().
+  struct PathQuery {
+    PathList paths;
+    // The enumeration went over the path budget and gave up, so paths
+    // is empty even though there are some.
+    bool overBudget{false};
+  };
+  const PathQuery &findAllSimplePathsCached(BasicBlock *bindSite,
+                                            BasicBlock *src, BasicBlock *dst,
+                                            bool allowSelfCycle = true);
+  const PathRegion &findPathRegionCached(BasicBlock *bindSite,
+                                         BasicBlock *src, BasicBlock *dst);
+
+  // Enumerating simple paths is exponential in the worst case, so we
+  // let the user bound how many paths a query may have (0 for no
+  // limit). A query that goes over budget gives up and returns no
+  // paths, with overBudget set; exceedsPathBudget says whether that
+  // happens, so the caller can fall back to something that works on
+  // regions.
+  void setPathBudget(unsigned maxPaths) { pathBudget_ = maxPaths; }
+  unsigned pathBudget() const { return pathBudget_; }
+  bool exceedsPathBudget(BasicBlock *bindSite,
+                         BasicBlock *src, BasicBlock *dst,
+                         bool allowSelfCycle = true);
+
+  struct QueryStats {
+    unsigned hits{0};
+    unsigned misses{0};
+  };
+  const QueryStats &pathQueryStats() const { return pathStats_; }
+  const QueryStats &regionQueryStats() const { return regionStats_; }
+  // How many paths the path query misses have turned up in all
+  unsigned pathsEnumerated() const { return pathsEnumerated_; }
+  // Seconds spent answering path and region query misses
+  double queryTime() const { return queryTime_; }
 
   static const PathID kEmptyPath = -1;
   typedef std::pair<BasicBlock *, PathID> PathCacheKey;
@@ -60,9 +166,48 @@ public:
 private:
   std::vector<PathCacheEntry> entries_;
   DenseMap<PathCacheKey, PathID> cache_;
-  DenseMap<BasicBlock *, SCCMap> sccCache_;
+  // Flattened copies of paths, made on demand by extractPath
+  mutable BumpPtrAllocator pathArena_;
+  mutable std::vector<Path> flatPaths_;
+  DenseMap<BasicBlock *, SCCIndex> sccCache_;
+
+  Function *func_{nullptr};
+  std::vector<BasicBlock *> blocks_;
+  DenseMap<BasicBlock *, unsigned> blockIDs_;
+  // The CFG, by block ID, with returns looping back to the entry
+  typedef SmallVector<BasicBlock *, 2> BlockList;
+  std::vector<BlockList> succs_;
+  std::vector<BlockList> preds_;
+  void numberBlocks(Function *func);
+  BlockSet emptyBlockSet(BasicBlock *block);
+  template <class F> void forwardIterate(BasicBlock *src, F f);
+  template <class F> void backwardIterate(BasicBlock *src, F f);
+
+  typedef std::tuple<BasicBlock *, BasicBlock *, BasicBlock *, bool>
+    PathQueryKey;
+  std::map<PathQueryKey, PathQuery> pathQueries_;
+  std::map<PathQueryKey, PathRegion> regionQueries_;
+  QueryStats pathStats_;
+  QueryStats regionStats_;
+  unsigned pathsEnumerated_{0};
+  double queryTime_{0};
+
+  unsigned pathBudget_{0};
+  // Progress of the current enumeration against the budget
+  unsigned pathsFound_{0};
+  unsigned pathSteps_{0};
+  bool overBudget_{false};
+  void resetBudget() { pathsFound_ = pathSteps_ = 0; overBudget_ = false; }
 
   PathID addToPath(BasicBlock *b, PathID id);
+  PathList findAllSimplePaths(BlockSet *grey, BasicBlock *src, BasicBlock *dst,
+                              bool allowSelfCycle);
+  template <class Next>
+  void regionSearch(BasicBlock *from, BasicBlock *to, BasicBlock *skip,
+                    BlockSet *seen, Next next);
+  template <class Post>
+  void findAllReachableDFS(BlockSet *grey, BasicBlock *src, bool backwards,
+                           Post post);
 };
 
 }
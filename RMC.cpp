@@ -24,17 +24,21 @@
 
 #include <llvm/Transforms/Scalar.h>
 #include <llvm/Transforms/Utils/BasicBlockUtils.h>
+#include <llvm/Transforms/Utils/Local.h>
 
 #include <llvm/ADT/ArrayRef.h>
 #include <llvm/ADT/SmallVector.h>
 #include <llvm/ADT/DenseMap.h>
 #include <llvm/ADT/SmallPtrSet.h>
+#include <llvm/ADT/Statistic.h>
 #include <llvm/ADT/iterator_range.h>
 
 #include <llvm/IR/Dominators.h>
+#include <llvm/IR/DiagnosticInfo.h>
 #include <llvm/Analysis/LoopInfo.h>
 
 
+#include <llvm/Support/Format.h>
 #include <llvm/Support/raw_ostream.h>
 
 #include <llvm/Support/CommandLine.h>
@@ -42,12 +46,15 @@
 #include <llvm/Transforms/IPO/PassManagerBuilder.h>
 #include <llvm/IR/LegacyPassManager.h>
 
+#include <cstdio>
 #include <ostream>
 #include <fstream>
 #include <sstream>
 #include <iostream>
+#include <atomic>
 #include <map>
 #include <set>
+#include <thread>
 
 #undef NDEBUG
 #include <assert.h>
@@ -57,8 +64,24 @@ static const bool kUseTransitiveHiding = true;
 
 using namespace llvm;
 
+#define DEBUG_TYPE "realize-rmc"
+
+STATISTIC(NumActions, "Number of RMC actions");
+STATISTIC(NumEdges, "Number of RMC edges after pruning");
+STATISTIC(NumPaths, "Number of simple paths enumerated");
+STATISTIC(NumSMTFunctions, "Number of functions solved with SMT");
+STATISTIC(NumSMTCached, "Number of functions whose SMT solution was cached");
+STATISTIC(NumSMTVars, "Number of SMT variables");
+STATISTIC(NumSMTAssertions, "Number of SMT assertions");
+STATISTIC(NumSolverCalls, "Number of calls to the SMT solver");
+
 cl::opt<bool> DebugSpew("rmc-debug-spew",
                         cl::desc("Enable RMC debug spew"));
+cl::opt<unsigned> MaxPaths(
+  "rmc-max-paths",
+  cl::desc("Maximum number of paths to consider between two actions "
+           "before falling back to a less precise analysis (0 = no limit)"),
+  cl::init(0));
 
 static void rmc_error() {
   exit(1);
@@ -109,44 +132,106 @@ raw_ostream& operator<<(raw_ostream& os, const RMCEdge& e) {
   return os;
 }
 
+ActionGraph::Builder::Builder(unsigned numActions) {
+  for (auto type : kEdgeTypes) {
+    rows_[type].resize(numActions);
+  }
+}
+
+void ActionGraph::Builder::add(RMCEdgeType type, unsigned src, unsigned dst,
+                               BasicBlock *bindSite) {
+  auto key = std::make_pair(src, dst);
+  auto &row = rows_[type][src];
+  auto i = index_[type].find(key);
+  if (i == index_[type].end()) {
+    index_[type].insert(std::make_pair(key, unsigned(row.size())));
+    row.push_back({dst, {bindSite}});
+    return;
+  }
+  auto &binds = row[i->second].bindSites;
+  if (std::find(binds.begin(), binds.end(), bindSite) == binds.end()) {
+    binds.push_back(bindSite);
+  }
+}
+
+void ActionGraph::Builder::addIfMissing(RMCEdgeType type, unsigned src,
+                                        const Entry &entry) {
+  auto key = std::make_pair(src, entry.dst);
+  if (index_[type].count(key)) return;
+  index_[type].insert(std::make_pair(key, unsigned(rows_[type][src].size())));
+  rows_[type][src].push_back(entry);
+}
+
+ActionGraph ActionGraph::Builder::finish() const {
+  ActionGraph graph;
+  graph.numActions_ = numActions();
+  for (auto type : kEdgeTypes) {
+    graph.rowStart_[type].reserve(numActions() + 1);
+    graph.edges_[type].reserve(index_[type].size());
+    graph.rowStart_[type].push_back(0);
+    for (auto & row : rows_[type]) {
+      for (auto & entry : row) {
+        unsigned begin = graph.bindSites_.size();
+        graph.bindSites_.insert(graph.bindSites_.end(),
+                                entry.bindSites.begin(),
+                                entry.bindSites.end());
+        graph.edges_[type].push_back(
+          {entry.dst, begin, unsigned(graph.bindSites_.size())});
+      }
+      graph.rowStart_[type].push_back(graph.edges_[type].size());
+    }
+  }
+  return graph;
+}
+
 }
 
 // Compute the transitive closure of the action graph
-template <typename Range, typename F>
-void transitiveClosure(Range &actions,
+template <typename F>
+void transitiveClosure(ActionGraph::Builder &graph,
                        RMCEdgeType type,
                        F merge) {
-  // Use Warshall's algorithm to compute the transitive closure. More
-  // or less. I can probably be a little more clever since I have
-  // adjacency lists, right? But n is small and this is really easy.
-  for (auto & k : actions) {
-    for (auto & i : actions) {
-      for (auto & j : actions) {
-        // OK, now we need to transitively join all of the ki and ij
-        // edges by merging the bind sites of each combination.
-        // (Although probably there is only one of each.)
-        // If there *aren't* both ik and kj edges, we skip the inner
-        // loop to avoid empty entries being automagically created.
-        if (!(i.transEdges[type].count(&k) &&
-              k.transEdges[type].count(&j))) continue;
-
-        for (BasicBlock *bind_ik : i.transEdges[type][&k]) {
-          for (BasicBlock *bind_kj : k.transEdges[type][&j]) {
-            BasicBlock *bind_ij = merge(bind_ik, bind_kj);
-            i.transEdges[type][&j].insert(bind_ij);
+  // Warshall's algorithm, but with the reachability kept as a bit
+  // matrix, so that finding which i and j to join through k doesn't
+  // take map lookups, and a row's update is a word-wise OR. Going
+  // through i and j in order keeps the order that edges get added to
+  // the rows, which the greedy algorithm cares about.
+  unsigned n = graph.numActions();
+  std::vector<BitVector> reach(n, BitVector(n));
+  for (unsigned i = 0; i < n; ++i) {
+    for (auto & entry : graph.row(type, i)) {
+      reach[i].set(entry.dst);
+    }
+  }
+
+  SmallVector<BasicBlock *, 2> binds_ik, binds_kj;
+  for (unsigned k = 0; k < n; ++k) {
+    for (unsigned i = 0; i < n; ++i) {
+      if (!reach[i].test(k)) continue;
+      // OK, now we need to transitively join all of the ki and ij
+      // edges by merging the bind sites of each combination.
+      // (Although probably there is only one of each.)
+      // i and k can be the same, and adding to the graph can move
+      // things around, so copy the bind sites out before adding to
+      // them.
+      for (int j = reach[k].find_first(); j != -1; j = reach[k].find_next(j)) {
+        auto &ik = graph.find(type, i, k)->bindSites;
+        binds_ik.assign(ik.begin(), ik.end());
+        auto &kj = graph.find(type, k, j)->bindSites;
+        binds_kj.assign(kj.begin(), kj.end());
+        for (BasicBlock *bind_ik : binds_ik) {
+          for (BasicBlock *bind_kj : binds_kj) {
+            graph.add(type, i, j, merge(bind_ik, bind_kj));
           }
         }
-
       }
+      if (i != k) reach[i] |= reach[k];
     }
   }
 }
 
 ///////////////////////////////////////////////////////////////////////////
 
-// It is sort of bogus to make this global.
-RMCTarget target;
-
 bool isARM(RMCTarget target) {
   return target == TargetARM || target == TargetARMv8;
 }
@@ -155,8 +240,7 @@ bool isARM(RMCTarget target) {
 // assembly to keep llvm from getting clever and merging them.
 // This is awful.
 std::string uniqueStr() {
-  // This isn't threadsafe but whatever
-  static int i = 0;
+  static std::atomic<int> i(0);
   std::ostringstream buffer;
   buffer << i++;
   return buffer.str();
@@ -179,7 +263,7 @@ Instruction *makeBarrier(Instruction *to_precede) {
   InlineAsm *a = makeAsm(f_ty, "# barrier", "~{memory}", true);
   return CallInst::Create(a, None, "", to_precede);
 }
-Instruction *makeSync(Instruction *to_precede) {
+Instruction *makeSync(RMCTarget target, Instruction *to_precede) {
   LLVMContext &C = to_precede->getContext();
   FunctionType *f_ty = FunctionType::get(FunctionType::getVoidTy(C), false);
   InlineAsm *a = nullptr;
@@ -192,7 +276,7 @@ Instruction *makeSync(Instruction *to_precede) {
   }
   return CallInst::Create(a, None, "", to_precede);
 }
-Instruction *makeLwsync(Instruction *to_precede) {
+Instruction *makeLwsync(RMCTarget target, Instruction *to_precede) {
   LLVMContext &C = to_precede->getContext();
   FunctionType *f_ty = FunctionType::get(FunctionType::getVoidTy(C), false);
   InlineAsm *a = nullptr;
@@ -211,7 +295,7 @@ Instruction *makeLwsync(Instruction *to_precede) {
   }
   return CallInst::Create(a, None, "", to_precede);
 }
-Instruction *makeDmbSt(Instruction *to_precede) {
+Instruction *makeDmbSt(RMCTarget target, Instruction *to_precede) {
   LLVMContext &C = to_precede->getContext();
   FunctionType *f_ty = FunctionType::get(FunctionType::getVoidTy(C), false);
   InlineAsm *a = nullptr;
@@ -224,7 +308,7 @@ Instruction *makeDmbSt(Instruction *to_precede) {
   }
   return CallInst::Create(a, None, "", to_precede);
 }
-Instruction *makeDmbLd(Instruction *to_precede) {
+Instruction *makeDmbLd(RMCTarget target, Instruction *to_precede) {
   LLVMContext &C = to_precede->getContext();
   FunctionType *f_ty = FunctionType::get(FunctionType::getVoidTy(C), false);
   InlineAsm *a = nullptr;
@@ -239,7 +323,7 @@ Instruction *makeDmbLd(Instruction *to_precede) {
   }
   return CallInst::Create(a, None, "", to_precede);
 }
-Instruction *makeIsync(Instruction *to_precede) {
+Instruction *makeIsync(RMCTarget target, Instruction *to_precede) {
   LLVMContext &C = to_precede->getContext();
   FunctionType *f_ty =
     FunctionType::get(FunctionType::getVoidTy(C), false);
@@ -253,7 +337,8 @@ Instruction *makeIsync(Instruction *to_precede) {
   }
   return CallInst::Create(a, None, "", to_precede);
 }
-Instruction *makeCtrl(Value *v, Instruction *to_precede) {
+Instruction *makeCtrl(RMCTarget target, Value *v,
+                      Instruction *to_precede) {
   LLVMContext &C = v->getContext();
   FunctionType *f_ty =
     FunctionType::get(FunctionType::getVoidTy(C), v->getType(), false);
@@ -269,9 +354,10 @@ Instruction *makeCtrl(Value *v, Instruction *to_precede) {
   }
   return CallInst::Create(a, v, "", to_precede);
 }
-Instruction *makeCtrlIsync(Value *v, Instruction *to_precede) {
-  Instruction *i = makeIsync(to_precede);
-  makeCtrl(v, i);
+Instruction *makeCtrlIsync(RMCTarget target, Value *v,
+                           Instruction *to_precede) {
+  Instruction *i = makeIsync(target, to_precede);
+  makeCtrl(target, v, i);
   return i;
 }
 Instruction *makeCopy(Value *v, Instruction *to_precede) {
@@ -291,12 +377,33 @@ Instruction *makeCopy(Value *v, Instruction *to_precede) {
   (LLVM_VERSION_MINOR >= 5 && LLVM_VERSION_MINOR <= 6)
 // Some annoying changes with how LoopInfo interacts with the pass manager
 #define LOOPINFO_PASS_NAME LoopInfo
-LoopInfo &getLoopInfo(const Pass &pass) {
+LoopInfo &getLoopInfo(Pass &pass, Function &F) {
+  return pass.getAnalysis<LoopInfo>(F);
+}
+LoopInfo &getLoopInfo(Pass &pass) {
   return pass.getAnalysis<LoopInfo>();
 }
+// Given a function pass, SplitCriticalEdge keeps its dominator tree
+// and loop info up to date.
+BasicBlock *splitCriticalEdge(TerminatorInst *term, unsigned i, Pass *pass) {
+  return SplitCriticalEdge(term, i, pass);
+}
 // And the signature of SplitBlock changed...
+// SplitBlock would find the analyses to update through the pass, but
+// it can't find a module pass's per-function ones, so do it by hand.
 BasicBlock *RealizeRMC::splitBlock(BasicBlock *Old, Instruction *SplitPt) {
-  return llvm::SplitBlock(Old, SplitPt, underlyingPass_);
+  BasicBlock *New = llvm::SplitBlock(Old, SplitPt, nullptr);
+  if (Loop *L = loopInfo_->getLoopFor(Old)) {
+    L->addBasicBlockToLoop(New, loopInfo_->getBase());
+  }
+  if (DomTreeNode *OldNode = domTree_->getNode(Old)) {
+    std::vector<DomTreeNode *> Children(OldNode->begin(), OldNode->end());
+    DomTreeNode *NewNode = domTree_->addNewBlock(New, Old);
+    for (auto *Child : Children) {
+      domTree_->changeImmediateDominator(Child, NewNode);
+    }
+  }
+  return New;
 }
 
 #elif (LLVM_VERSION_MAJOR == 3 &&                       \
@@ -304,36 +411,30 @@ BasicBlock *RealizeRMC::splitBlock(BasicBlock *Old, Instruction *SplitPt) {
   LLVM_VERSION_MAJOR == 4
 
 #define LOOPINFO_PASS_NAME LoopInfoWrapperPass
-LoopInfo &getLoopInfo(const Pass &pass) {
+LoopInfo &getLoopInfo(Pass &pass, Function &F) {
+  return pass.getAnalysis<LoopInfoWrapperPass>(F).getLoopInfo();
+}
+LoopInfo &getLoopInfo(Pass &pass) {
   return pass.getAnalysis<LoopInfoWrapperPass>().getLoopInfo();
 }
+BasicBlock *splitCriticalEdge(TerminatorInst *term, unsigned i, Pass *pass) {
+  DominatorTree *dom = nullptr;
+  LoopInfo *li = nullptr;
+  if (pass) {
+    dom = &pass->getAnalysis<DominatorTreeWrapperPass>().getDomTree();
+    li = &getLoopInfo(*pass);
+  }
+  return SplitCriticalEdge(term, i, CriticalEdgeSplittingOptions(dom, li));
+}
 
 BasicBlock *RealizeRMC::splitBlock(BasicBlock *Old, Instruction *SplitPt) {
-  return llvm::SplitBlock(Old, SplitPt, &domTree_, &loopInfo_);
+  return llvm::SplitBlock(Old, SplitPt, domTree_, loopInfo_);
 }
 
 #else
 #error Unsupported LLVM version
 #endif
 
-#if (LLVM_VERSION_MAJOR == 3 && LLVM_VERSION_MINOR >= 9) || \
-  LLVM_VERSION_MAJOR == 4
-bool keepValueNames(Function &func) {
-  LLVMContext &ctx = func.getContext();
-  bool discard = ctx.shouldDiscardValueNames();
-  ctx.setDiscardValueNames(false);
-  return discard;
-}
-void restoreValueNames(Function &func, bool discard) {
-  LLVMContext &ctx = func.getContext();
-  ctx.setDiscardValueNames(discard);
-}
-#else
-bool keepValueNames(Function &func) { return false; }
-void restoreValueNames(Function &func, bool discard) { }
-#endif
-
-
 ///////////////////////////////////////////////////////////////////////////
 //// Code to pull random crap out of LLVM functions
 namespace llvm {
@@ -417,7 +518,7 @@ Action *RealizeRMC::makePrePostAction(BasicBlock *bb) {
     return bb2action_[bb];
   }
 
-  actions_.emplace_back(bb, bb);
+  actions_.emplace_back(actions_.size(), bb, bb);
   Action *a = &actions_.back();
   bb2action_[bb] = a;
   a->type = ActionPrePost;
@@ -434,8 +535,7 @@ void registerEdge(std::vector<RMCEdge> &edges,
                   RMCEdgeType edgeType,
                   BasicBlock *bindSite,
                   Action *src, Action *dst) {
-  // Insert into the graph and the list of edges
-  src->edges[edgeType][dst].insert(bindSite);
+  // The graph gets built from the list once we have all of them
   edges.push_back({edgeType, src, dst, bindSite});
 }
 
@@ -696,13 +796,7 @@ void RealizeRMC::findActions() {
     }
   }
 
-  // Now, make the vector of actions and a mapping from BasicBlock *.
-  // We, somewhat tastelessly, reserve space for 3x the number of
-  // actions we actually have so that we have space for new pre/post
-  // actions that we might need to dummy up.
-  // We need to have all the space reserved in advance so that our
-  // pointers don't get invalidated when a resize happens.
-  actions_.reserve(3 * registrations.size());
+  // Now, make the list of actions and a mapping from BasicBlock *.
   numNormalActions_ = registrations.size();
   for (auto reg : registrations) {
     // FIXME: this scheme only works if we've run mem2reg. Otherwise we
@@ -745,7 +839,7 @@ void RealizeRMC::findActions() {
     // We work around this in a hacky way by storing the *end* block
     // instead and then patching them up once we have processed all
     // the actions.
-    actions_.emplace_back(main, end, name);
+    actions_.emplace_back(actions_.size(), main, end, name);
     bb2action_[main] = &actions_.back();
 
     deleteRegisterCall(reg);
@@ -760,17 +854,17 @@ void RealizeRMC::findActions() {
   }
 }
 
-void dumpGraph(std::vector<Action> &actions) {
+void dumpGraph(ActionList &actions, const ActionGraph &graph) {
   // Debug spew!!
   for (auto & src : actions) {
-    errs() << "Action: " << src.bb->getName().substr(5) << ": " <<
+    errs() << "Action: " << src.debugName() << ": " <<
       src.type << "\n";
   }
   for (auto & src : actions) {
     for (auto edgeType : kEdgeTypes) {
-      for (auto entry : src.transEdges[edgeType]) {
-        auto *dst = entry.first;
-        for (auto *bindSite : entry.second) {
+      for (auto & edge : graph.edges(edgeType, src.id)) {
+        auto *dst = &actions[edge.dst];
+        for (auto *bindSite : graph.bindSites(edge)) {
           errs() << "Edge: " << RMCEdge{edgeType, &src, dst, bindSite} << "\n";
         }
       }
@@ -787,19 +881,19 @@ BasicBlock *mergeBindPoints(DominatorTree &domTree,
   return dom;
 }
 
-// argh, MapVector doesn't have .insert() for ranges
-template <typename A, typename B>
-void insert(A &to, B &from) { for (auto & x : from) to.insert(x); }
-
-void buildActionGraph(std::vector<Action> &actions, int numReal,
-                      DominatorTree &domTree) {
+ActionGraph buildActionGraph(ActionList &actions, int numReal,
+                             const std::vector<RMCEdge> &edges,
+                             DominatorTree &domTree) {
   // Copy the initial edge specifications into the transitive graph
+  ActionGraph::Builder graph(actions.size());
+  for (auto & edge : edges) {
+    graph.add(edge.edgeType, edge.src->id, edge.dst->id, edge.bindSite);
+  }
   for (auto & a : actions) {
-    for (auto edgeType : kEdgeTypes) {
-      insert(a.transEdges[edgeType], a.edges[edgeType]);
-    }
     // Visibility implies execution.
-    insert(a.transEdges[ExecutionEdge], a.edges[VisibilityEdge]);
+    for (auto & entry : graph.row(VisibilityEdge, a.id)) {
+      graph.addIfMissing(ExecutionEdge, a.id, entry);
+    }
     // Push implies visibility and execution, but not in a way that we
     // need to track explicitly. Because push edges can't be useless,
     // they'll never get dropped from the graph, so it isn't important
@@ -807,16 +901,24 @@ void buildActionGraph(std::vector<Action> &actions, int numReal,
     // (Although maybe we ought to, for consistency?)
   }
 
+  // The same pairs of bind sites come up over and over.
+  DenseMap<std::pair<BasicBlock *, BasicBlock *>, BasicBlock *> merged;
   auto merge = [&] (BasicBlock *b1, BasicBlock *b2) {
-    return mergeBindPoints(domTree, b1, b2);
+    auto key = std::make_pair(b1, b2);
+    auto entry = merged.find(key);
+    if (entry != merged.end()) return entry->second;
+    BasicBlock *dom = mergeBindPoints(domTree, b1, b2);
+    merged.insert(std::make_pair(key, dom));
+    return dom;
   };
 
   // Now compute the closures.  We previously ignored pre/post edges,
   // which was wrong; was it on to /anything/, though?
   //auto realActions = make_range(actions.begin(), actions.begin() + numReal);
   for (auto edgeType : kEdgeTypes) {
-    transitiveClosure(actions, edgeType, merge);
+    transitiveClosure(graph, edgeType, merge);
   }
+  return graph.finish();
 }
 
 ////////////// Chicanery to handle disguising operands
@@ -1049,10 +1151,12 @@ bool addrDepsOnSearch(Value *pointer, Value *load,
   return false;
 }
 
-bool addrDepsOn(Use *use, Value *load,
-                PathCache *cache, BasicBlock *bindSite,
-                PathID pathid,
-                std::vector<std::vector<Instruction *> > *trails) {
+// Check for an address dependency that holds when we might take any
+// detour off of the blocks in path.
+bool addrDepsOnSCCs(Use *use, Value *load,
+                    PathCache *cache, BasicBlock *bindSite,
+                    BitVector reachableSccs,
+                    std::vector<std::vector<Instruction *> > *trails) {
   Instruction *pointer = dyn_cast<Instruction>(use->get());
   Instruction *load_instr = dyn_cast<Instruction>(load);
   if (!pointer || !load_instr) return false;
@@ -1067,24 +1171,23 @@ bool addrDepsOn(Use *use, Value *load,
   // the path.
   //
   // In practice, we only need to *check* membership in that set, not
-  // enumerate it. Thus we can optimize the setup process by only
-  // collecting the e canonical elements of the SCC for each path
-  // node.
-  Path path = cache->extractPath(pathid);
-  auto sccs_ptr = cache->findSCCsCached(bindSite, path[0]->getParent());
-  auto &sccs = *sccs_ptr;
-  PathCache::SkipSet reachableSccs;
-  for (auto *u : path) reachableSccs.insert(sccs[u]);
+  // enumerate it. Thus our caller just hands us the set of SCC
+  // numbers that the path touches.
+  auto &sccs = cache->findSCCsCached(bindSite,
+                                     load_instr->getParent()->getParent());
+  reachableSccs.resize(sccs.numSCCs());
   auto reachable_p = [&] (BasicBlock *b) {
-    return reachableSccs.count(sccs[b]) > 0;
+    return reachableSccs.test(sccs.sccOf[cache->blockID(b)]);
   };
 
   if (DebugSpew) {
-    errs() << "from: " << load_instr->getParent()->getName() << " ";
-    if (bindSite) errs() << "bound: " << bindSite->getName() << " ";
+    errs() << "from: " << blockName(load_instr->getParent()) << " ";
+    if (bindSite) errs() << "bound: " << blockName(bindSite) << " ";
     errs() << "reachable sccs: {";
-    for (BasicBlock *block : reachableSccs) {
-      errs() << block->getName() << ", ";
+    for (int i = reachableSccs.find_first(); i >= 0;
+         i = reachableSccs.find_next(i)) {
+      BasicBlock *block = sccs.canonical[i];
+      errs() << (block ? blockName(block) : "<skipped>") << ", ";
     }
     errs() << "}\n";
   }
@@ -1094,72 +1197,136 @@ bool addrDepsOn(Use *use, Value *load,
                           reachable_p, phis, trails);
 }
 
+bool addrDepsOn(Use *use, Value *load,
+                PathCache *cache, BasicBlock *bindSite,
+                PathID pathid,
+                std::vector<std::vector<Instruction *> > *trails) {
+  return addrDepsOnSCCs(use, load, cache, bindSite,
+                       cache->pathSCCs(bindSite, pathid), trails);
+}
+
+// Check for an address dependency that holds along *every* path in a
+// region. Since we check against every block that any path could
+// visit, this is conservative compared to checking the paths one at a
+// time.
+bool addrDepsOn(Use *use, Value *load,
+                PathCache *cache, BasicBlock *bindSite,
+                const PathCache::PathRegion &region,
+                std::vector<std::vector<Instruction *> > *trails) {
+  return addrDepsOnSCCs(use, load, cache, bindSite,
+                       cache->regionSCCs(bindSite, region), trails);
+}
+
 }
 
 
 ////////////// non-SMT specific compilation
 
-CutStrength RealizeRMC::isPathCut(const RMCEdge &edge,
-                                  PathID pathid,
-                                  bool enforceSoft,
-                                  bool justCheckCtrl) {
-  Path path = pc_.extractPath(pathid);
-  if (path.size() <= 1) return HardCut;
+// Instead of checking the paths from src to dst one at a time, we work
+// with the region of the CFG that they pass through and successively
+// remove the edges that are cut by something, strongest first. The
+// edge is cut as strongly as the strongest cut that leaves no path
+// through the region.
+//
+// Cuts are tracked on blocks, so we need to translate them to edges:
+// a cut at the front of a block cuts the edges into it and a cut at
+// the back cuts the edges out of it. This gets the endpoints right,
+// too: a cut at the front of src or the back of dst doesn't lie on the
+// path.
+const BlockCut *RealizeRMC::cutAt(BasicBlock *bb, bool isFront) {
+  auto cut_i = cuts_.find(bb);
+  if (cut_i == cuts_.end() || cut_i->second.isFront != isFront)
+    return nullptr;
+  return &cut_i->second;
+}
+
+// The part of an edge's region that isn't already cut by a fence.
+PathCache::PathRegion RealizeRMC::liveRegion(const RMCEdge &edge) {
+  const PathCache::PathRegion &region =
+    pc_.findPathRegionCached(edge.bindSite, edge.src->outBlock, edge.dst->bb);
+
+  auto hardCuts = [&] (const BlockCut *cut) {
+    // sync cuts; lwsync cuts
+    return cut && (cut->type == CutSync ||
+                   (cut->type == CutLwsync && edge.edgeType < PushEdge));
+  };
+  return pc_.restrictRegion(
+    region,
+    [&] (BasicBlock *src, BasicBlock *dst) {
+      return hardCuts(cutAt(src, false)) || hardCuts(cutAt(dst, true));
+    });
+}
 
-  bool hasSoftCut = false;
-  Value *outgoingDep = edge.src->outgoingDep;
+CutStrength RealizeRMC::isEdgeCut(const RMCEdge &edge,
+                                  bool enforceSoft, bool justCheckCtrl) {
+  PathCache::PathRegion live = liveRegion(edge);
+  if (live.empty()) return HardCut;
 
-  // Paths are backwards.
-  for (auto i = path.begin(), e = path.end(); i != e; ++i) {
-    bool isFront = i == path.begin(), isBack = i == e-1;
-    BasicBlock *bb = *i;
-
-    auto cut_i = cuts_.find(bb);
-    if (cut_i != cuts_.end()) {
-      const BlockCut &cut = cut_i->second;
-      bool cutHits = !(isFront && cut.isFront) && !(isBack && !cut.isFront);
-      if (cutHits) {
-        // sync cuts
-        if (cut.type == CutSync) {
-          return HardCut;
-        }
-        // lwsync cuts
-        if (cut.type == CutLwsync && edge.edgeType < PushEdge) {
-          return HardCut;
-        }
-        // ctrlisync cuts
-        if (edge.edgeType == ExecutionEdge &&
-            cut.type == CutCtrlIsync &&
-            cut.read == outgoingDep) {
-          return SoftCut;
-        }
-      }
-    }
+  Value *outgoingDep = edge.src->outgoingDep;
 
-    if (isBack) continue;
-    // If the destination is a write, and this is an execution edge,
-    // and the source is a read, then we can just take advantage of a
-    // control dependency to get a soft cut.  Also, if we are just
-    // checking to make sure there is a control dep, we don't care
-    // about what the dest does..
-    if (edge.edgeType != ExecutionEdge || !outgoingDep) continue;
-    if (!(edge.dst->type == ActionSimpleWrites ||
-          edge.dst->type == ActionSimpleRMW ||
-          justCheckCtrl)) continue;
-    if (hasSoftCut) continue;
+  auto softCuts = [&] (const BlockCut *cut) {
+    // ctrlisync cuts
+    return cut && edge.edgeType == ExecutionEdge &&
+      cut->type == CutCtrlIsync && cut->read == outgoingDep;
+  };
 
+  // If the destination is a write, and this is an execution edge,
+  // and the source is a read, then we can just take advantage of a
+  // control dependency to get a soft cut.  Also, if we are just
+  // checking to make sure there is a control dep, we don't care
+  // about what the dest does..
+  bool canUseCtrl = edge.edgeType == ExecutionEdge && outgoingDep &&
+    (edge.dst->type == ActionSimpleWrites ||
+     edge.dst->type == ActionSimpleRMW ||
+     justCheckCtrl);
+  DenseMap<BasicBlock *, std::pair<ICmpInst *, int>> branches;
+  auto branchCuts = [&] (BasicBlock *bb) {
+    if (!canUseCtrl) return false;
+    auto branch_i = branches.find(bb);
+    if (branch_i != branches.end()) return true;
     // Is there a branch on the load?
     int idx;
     ICmpInst *icmp;
-    hasSoftCut = branchesOn(bb, outgoingDep, &icmp, &idx);
+    if (!branchesOn(bb, outgoingDep, &icmp, &idx)) return false;
+    branches[bb] = std::make_pair(icmp, idx);
+    return true;
+  };
 
-    if (hasSoftCut && enforceSoft) {
-      BasicBlock *next = *(i+1);
-      enforceBranchOn(next, icmp, idx);
+  PathCache::PathRegion weak = pc_.restrictRegion(
+    live,
+    [&] (BasicBlock *src, BasicBlock *dst) {
+      return branchCuts(src) ||
+        softCuts(cutAt(src, false)) || softCuts(cutAt(dst, true));
+    });
+
+  // Make sure the first branch along each path survives optimization.
+  if (enforceSoft && !branches.empty()) {
+    // Index the live edges by their source so the walk is linear.
+    DenseMap<BasicBlock *, SmallVector<BasicBlock *, 2>> liveSuccs;
+    for (auto & liveEdge : live.edges) {
+      liveSuccs[liveEdge.first].push_back(liveEdge.second);
+    }
+    PathCache::BlockSet seen(pc_.numBlocks());
+    std::vector<BasicBlock *> worklist{live.src};
+    while (!worklist.empty()) {
+      BasicBlock *bb = worklist.back();
+      worklist.pop_back();
+      auto branch_i = branches.find(bb);
+      auto succs_i = liveSuccs.find(bb);
+      if (succs_i == liveSuccs.end()) continue;
+      for (BasicBlock *next : succs_i->second) {
+        if (branch_i != branches.end()) {
+          enforceBranchOn(next, branch_i->second.first,
+                          branch_i->second.second);
+        } else if (next != live.dst && !seen.test(pc_.blockID(next))) {
+          seen.set(pc_.blockID(next));
+          worklist.push_back(next);
+        }
+      }
     }
   }
 
-  if (hasSoftCut) return SoftCut;
+  if (weak.empty()) return SoftCut;
 
   // Try a data cut
   // See if we have a data dep in a very basic way.
@@ -1168,7 +1335,7 @@ CutStrength RealizeRMC::isPathCut(const RMCEdge &edge,
   auto trailp = enforceSoft && !kUseTransitiveHiding ? &trails : nullptr;
   if (edge.src->outgoingDep && edge.dst->incomingDep &&
       addrDepsOn(edge.dst->incomingDep, edge.src->outgoingDep,
-                 &pc_, edge.bindSite, pathid, trailp)) {
+                 &pc_, edge.bindSite, weak, trailp)) {
     if (enforceSoft) {
       if (kUseTransitiveHiding) {
         enforceAddrDeps(edge.src->outgoingDep);
@@ -1184,24 +1351,6 @@ CutStrength RealizeRMC::isPathCut(const RMCEdge &edge,
   return NoCut;
 }
 
-CutStrength RealizeRMC::isEdgeCut(const RMCEdge &edge,
-                                  bool enforceSoft, bool justCheckCtrl) {
-  CutStrength strength = HardCut;
-
-  PathCache::SkipSet skip;
-  if (edge.bindSite) skip.insert(edge.bindSite);
-  PathList paths =
-    pc_.findAllSimplePaths(&skip, edge.src->outBlock, edge.dst->bb);
-  //pc_.dumpPaths(paths);
-  for (auto & path : paths) {
-    CutStrength pathStrength = isPathCut(edge, path,
-                                         enforceSoft, justCheckCtrl);
-    if (pathStrength < strength) strength = pathStrength;
-  }
-
-  return strength;
-}
-
 bool RealizeRMC::isCut(const RMCEdge &edge) {
   RMCEdge selfEdge = RMCEdge{edge.edgeType, edge.src, edge.src, edge.bindSite};
 
@@ -1232,90 +1381,208 @@ bool RealizeRMC::isCut(const RMCEdge &edge) {
   }
 }
 
-void RealizeRMC::cutEdge(RMCEdge &edge) {
-  if (isCut(edge)) return;
+// How often we expect CFG edges (and blocks) to run; see
+// computeCapacities.
+const EdgeCapacities &RealizeRMC::getEdgeCaps() {
+  if (!haveEdgeCaps_) {
+    edgeCaps_ = computeCapacities(*loopInfo_, func_);
+    haveEdgeCaps_ = true;
+  }
+  return edgeCaps_;
+}
+
+// Cut every uncut path for an edge with the cheapest set of fences,
+// weighing CFG edges by how often they execute. Since critical edges
+// have been broken, a CFG edge can always be cut at the back of its
+// source or the front of its destination without affecting any other
+// edges, the same way insertCut places things for the SMT backend.
+//
+// For visibility and push edges, fences are the only thing that can
+// cut, so this is exactly right. For execution edges we don't try to
+// combine fences with ctrl or data deps; we just use fences for
+// whatever isEdgeCut couldn't handle.
+bool RealizeRMC::minCutEdge(const RMCEdge &edge, CutType type, bool dryRun) {
+  PathCache::PathRegion live = liveRegion(edge);
+
+  // Where a fence cutting src->dst would go
+  auto placement = [&] (BasicBlock *src, BasicBlock *dst) {
+    if (src->getTerminator()->getNumSuccessors() > 1) {
+      return std::make_pair(dst, true);
+    }
+    return std::make_pair(src, false);
+  };
+
+  const EdgeCapacities &edgeCaps = getEdgeCaps();
+  std::vector<PathCache::RegionEdge> cut;
+  bool found = pc_.findMinCut(
+    live,
+    [&] (BasicBlock *src, BasicBlock *dst) {
+      // We can only track one cut per block, so don't try to put a
+      // cut on the other side of a block that already has one.
+      auto place = placement(src, dst);
+      auto cut_i = cuts_.find(place.first);
+      if (cut_i != cuts_.end() && cut_i->second.isFront != place.second) {
+        return -1;
+      }
+      auto cap_i = edgeCaps.find(std::make_pair(src, dst));
+      return cap_i != edgeCaps.end() ? cap_i->second : 1;
+    },
+    &cut);
+  if (!found) return false;
+
+  for (auto & cutEdge : cut) {
+    auto place = placement(cutEdge.first, cutEdge.second);
+    BasicBlock *bb = place.first;
+    cuts_[bb] = BlockCut(type, place.second);
+    if (dryRun) continue;
+
+    Instruction *i_point =
+      place.second ? &*bb->getFirstInsertionPt() : bb->getTerminator();
+    if (DebugSpew) {
+      errs() << "Cutting " << edge << " at " << blockName(cutEdge.first)
+             << " -> " << blockName(cutEdge.second) << "\n";
+    }
+    if (type == CutSync) {
+      makeSync(target_, i_point);
+    } else {
+      makeLwsync(target_, i_point);
+    }
+  }
+
+  return true;
+}
+
+// If dryRun is set, we only work out where the fences would go (in
+// cuts_) and don't change anything. Since using ctrl and data deps
+// means changing the IR to make sure they survive, a dry run only
+// uses fences.
+void RealizeRMC::cutEdge(RMCEdge &edge, bool dryRun) {
+  if (dryRun ? liveRegion(edge).empty() : isCut(edge)) return;
 
-  // As a first pass, we just insert lwsyncs at the start of the destination.
-  // (Or syncs if it is a push edge)
+  // We use lwsyncs, or syncs if it is a push edge.
+  CutType type = edge.edgeType == PushEdge ? CutSync : CutLwsync;
+  if (minCutEdge(edge, type, dryRun)) return;
+
+  // If there's no way to do it without running into cuts we can't
+  // track, we just insert at the start of the destination.
   BasicBlock *bb = edge.dst->bb;
+  // XXX: we need to make sure we can't ever fail to track a cut at one side
+  // of a block because we inserted one at the other! Argh!
+  cuts_[bb] = BlockCut(type, true);
+  if (dryRun) return;
+
   Instruction *i_point = &*bb->getFirstInsertionPt();
-  if (edge.edgeType == PushEdge) {
-    makeSync(i_point);
+  if (type == CutSync) {
+    makeSync(target_, i_point);
   } else {
-    makeLwsync(i_point);
+    makeLwsync(target_, i_point);
   }
-  // XXX: we need to make sure we can't ever fail to track a cut at one side
-  // of a block because we inserted one at the other! Argh!
-  cuts_[bb] = BlockCut(CutLwsync, true);
 }
 
-void RealizeRMC::cutEdges() {
+// Whether any branch in the function has profile weights on it
+static bool hasProfileData(Function &F) {
+  for (auto & block : F) {
+    if (block.getTerminator()->getMetadata(LLVMContext::MD_prof)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void RealizeRMC::sortEdgesForGreedy(std::vector<RMCEdge> &edges) {
   // Sort the edges by edge type so we do push, vis, exec, which
   // results in better codegen with the crappy greedy algorithm.
   // Should maybe do some better sorting to do things like cutting
   // short edges first?
   // Stable sort to preserve the ordering of other stuff.
+  if (!hasProfileData(func_)) {
+    std::stable_sort(edges.begin(), edges.end(),
+                     [] (const RMCEdge &l, const RMCEdge &r) {
+                       return l.edgeType > r.edgeType;
+                     });
+    return;
+  }
+
+  // If we know where the hot code is, then within a type, do the
+  // edges in the hottest code first, so they get the cheapest cuts
+  // and colder edges make do with what is left (often getting cut
+  // along the way).
+  const EdgeCapacities &edgeCaps = getEdgeCaps();
+  auto blockCap = [&] (BasicBlock *bb) {
+    auto cap_i = edgeCaps.find(std::make_pair(bb, nullptr));
+    return cap_i != edgeCaps.end() ? cap_i->second : 0;
+  };
+  auto heat = [&] (const RMCEdge &edge) {
+    return std::max(blockCap(edge.src->bb), blockCap(edge.dst->bb));
+  };
   auto cmp = [&] (const RMCEdge &l, const RMCEdge &r) {
-    return l.edgeType > r.edgeType;
+    if (l.edgeType != r.edgeType) return l.edgeType > r.edgeType;
+    return heat(l) > heat(r);
   };
-  std::stable_sort(edges_.begin(), edges_.end(), cmp);
+  std::stable_sort(edges.begin(), edges.end(), cmp);
+}
 
-  // Now actually process the edges
+void RealizeRMC::cutEdges() {
+  sortEdgesForGreedy(edges_);
   for (auto & edge : edges_) {
     cutEdge(edge);
   }
 }
 
+// Where cutEdges() would put fences if it only used fences, for the
+// SMT solver to start from. Leaves cuts_ (and everything else) alone.
+DenseMap<BasicBlock *, BlockCut> RealizeRMC::greedyFences() {
+  assert(cuts_.empty());
+  std::vector<RMCEdge> edges = edges_;
+  sortEdgesForGreedy(edges);
+  for (auto & edge : edges) {
+    cutEdge(edge, true);
+  }
+  DenseMap<BasicBlock *, BlockCut> fences;
+  std::swap(fences, cuts_);
+  return fences;
+}
+
 ////////////// SMT specific compilation
 
 // Remove edges that have no effect (after transitive closure
-void removeUselessEdges(std::vector<Action> &actions) {
-  for (auto & src : actions) {
-    ActionType st = src.type;
-
-    // Move the set out and filter by building a new one to avoid
-    // iterator invalidation woes.
-    auto newExec = std::move(src.transEdges[ExecutionEdge]);
-    src.transEdges[ExecutionEdge].clear();
-    for (auto & entry : newExec) {
-      ActionType dt = entry.first->type;
-      if (!(st == ActionNop || dt == ActionNop ||
-            st == ActionSimpleWrites)) {
-        src.transEdges[ExecutionEdge].insert(std::move(entry));
-      }
-    }
-
-    auto newVis = std::move(src.transEdges[VisibilityEdge]);
-    src.transEdges[VisibilityEdge].clear();
-    for (auto & entry : newVis) {
-      ActionType dt = entry.first->type;
-      if (!(st == ActionNop || dt == ActionNop ||
-            /* R->R has same force as execution, and we made execution
-             * versions of all the vis edges. */
-            (st == ActionSimpleRead && dt == ActionSimpleRead) ||
-            (st == ActionSimpleWrites && dt == ActionSimpleRead))) {
-        src.transEdges[VisibilityEdge].insert(std::move(entry));
-      }
+ActionGraph removeUselessEdges(ActionList &actions, const ActionGraph &graph) {
+  return graph.filter([&] (RMCEdgeType edgeType, unsigned src, unsigned dst) {
+    ActionType st = actions[src].type;
+    ActionType dt = actions[dst].type;
+    switch (edgeType) {
+    case ExecutionEdge:
+      return !(st == ActionNop || dt == ActionNop ||
+               st == ActionSimpleWrites);
+    case VisibilityEdge:
+      return !(st == ActionNop || dt == ActionNop ||
+               /* R->R has same force as execution, and we made execution
+                * versions of all the vis edges. */
+               (st == ActionSimpleRead && dt == ActionSimpleRead) ||
+               (st == ActionSimpleWrites && dt == ActionSimpleRead));
+    default:
+      // Push edges are never useless, because even if they are a nop
+      // they interact with visibility and execution edges in a
+      // critical way. (And visibility and execution edges that we
+      // might not see.)
+      return true;
     }
-
-    // Push edges are never useless, because even if they are a nop
-    // they interact with visibility and execution edges in a critical way.
-    // (And visibility and execution edges that we might not see.)
-  }
+  });
 }
 
 // Given an action graph that has been modified, regenerate a list
 // of edges that can be processed more easily.
-std::vector<RMCEdge> rebuildEdges(std::vector<Action> &actions) {
+std::vector<RMCEdge> rebuildEdges(ActionList &actions,
+                                  const ActionGraph &graph) {
   std::vector<RMCEdge> edges;
 
   for (auto edgeType : kEdgeTypes) {
     for (auto & src : actions) {
-      for (auto & entry : src.transEdges[edgeType]) {
+      for (auto & edge : graph.edges(edgeType, src.id)) {
         // Generate one per binding site. There should basically
         // only ever be one, though.
-        for (BasicBlock *bindSite : entry.second) {
-          edges.push_back({edgeType, &src, entry.first, bindSite});
+        for (BasicBlock *bindSite : graph.bindSites(edge)) {
+          edges.push_back({edgeType, &src, &actions[edge.dst], bindSite});
         }
       }
     }
@@ -1386,21 +1653,21 @@ void RealizeRMC::insertCut(const EdgeCut &cut) {
 
   switch (cut.type) {
   case CutSync:
-    makeSync(getCutInstr(cut));
+    makeSync(target_, getCutInstr(cut));
     break;
   case CutLwsync:
     // FIXME: it would be nice if we were clever enough to notice when
     // every edge out of a block as the same cut and merge them.
-    makeLwsync(getCutInstr(cut));
+    makeLwsync(target_, getCutInstr(cut));
     break;
   case CutDmbSt:
-    makeDmbSt(getCutInstr(cut));
+    makeDmbSt(target_, getCutInstr(cut));
     break;
   case CutDmbLd:
-    makeDmbLd(getCutInstr(cut));
+    makeDmbLd(target_, getCutInstr(cut));
     break;
   case CutIsync:
-    makeIsync(getCutInstr(cut));
+    makeIsync(target_, getCutInstr(cut));
     break;
   case CutCtrl:
   {
@@ -1409,7 +1676,7 @@ void RealizeRMC::insertCut(const EdgeCut &cut) {
     if (branches) {
       enforceBranchOn(cut.dst, icmp, idx);
     } else {
-      makeCtrl(cut.read, getCutInstr(cut));
+      makeCtrl(target_, cut.read, getCutInstr(cut));
     }
     break;
   }
@@ -1444,20 +1711,17 @@ void RealizeRMC::insertCut(const EdgeCut &cut) {
 
 ////////////// Shared compilation
 
-bool RealizeRMC::run() {
-  findActions();
+bool RealizeRMC::prepare() {
+  PhaseTimer timer(stats_.prepareTime);
+  {
+    PhaseTimer timer(stats_.findActionsTime);
+    findActions();
+  }
   findEdges();
 
   if (actions_.empty() && edges_.empty()) return false;
 
-  // This is kind of silly, but we depend on blocks having names, so
-  // give a bogus name to any unnamed edges.
-  for (auto & block : func_) {
-    if (!block.hasName()) {
-      block.setName("<unnamed>");
-      assert(block.hasName());
-    }
-  }
+  pc_.setPathBudget(MaxPaths);
 
   if (DebugSpew) {
     errs() << "********************************************************\n";
@@ -1479,85 +1743,400 @@ bool RealizeRMC::run() {
   // Compute the transitive closure of the graph, prune actions that
   // were only meaningful for their transitive properties, and then
   // rebuild the edges list from the graph.
-  buildActionGraph(actions_, numNormalActions_, domTree_);
-  removeUselessEdges(actions_);
-  edges_ = std::move(rebuildEdges(actions_));
+  {
+    PhaseTimer timer(stats_.actionGraphTime);
+    graph_ = removeUselessEdges(
+      actions_,
+      buildActionGraph(actions_, numNormalActions_, edges_, *domTree_));
+    edges_ = rebuildEdges(actions_, graph_);
+  }
   if (DebugSpew) {
-    dumpGraph(actions_);
+    dumpGraph(actions_, graph_);
+  }
+
+  stats_.actions = actions_.size();
+  stats_.edges = edges_.size();
+  return true;
+}
+
+void RealizeRMC::detachAnalyses() {
+  concurrent_ = true;
+  // The capacities are all we need the loops for.
+  getEdgeCaps();
+  loopInfo_ = nullptr;
+  ownDomTree_.reset(new DominatorTree());
+  ownDomTree_->recalculate(func_);
+  domTree_ = ownDomTree_.get();
+}
+
+void RealizeRMC::analyze() {
+  if (useSMT_) {
+    smtGaveUp_ = !smtAnalyze(smtCuts_);
   }
+}
 
-  if (!useSMT_) {
+void RealizeRMC::apply() {
+  PhaseTimer timer(stats_.applyTime);
+  for (auto & remark : remarks_) {
+    emitOptimizationRemarkAnalysis(
+      func_.getContext(), "realize-rmc", func_,
+      remark.first->front().getDebugLoc(), remark.second);
+  }
+
+  if (!useSMT_ || smtGaveUp_) {
     cutEdges();
   } else {
-    auto cuts = smtAnalyze();
     //errs() << "Applying SMT results:\n";
-    for (auto & cut : cuts) {
+    for (auto & cut : smtCuts_) {
       insertCut(cut);
     }
   }
+  stats_.paths = pc_.pathsEnumerated();
+  stats_.pathTime = pc_.queryTime();
   if (DebugSpew) {
+    errs() << "Path queries: " << pc_.pathQueryStats().hits << " hits, "
+           << pc_.pathQueryStats().misses << " misses\n";
+    errs() << "Region queries: " << pc_.regionQueryStats().hits << " hits, "
+           << pc_.regionQueryStats().misses << " misses\n";
     errs() << "========================================\n";
     errs() << "Func body at end:\n" << func_ << "\n";
     errs() << "\n\n\n";
   }
+}
 
+bool RealizeRMC::run() {
+  if (!prepare()) return false;
+  analyze();
+  apply();
   return true;
 }
 
-#if USE_Z3
 cl::opt<bool> UseSMT("rmc-use-smt",
                      cl::desc("Use an SMT solver to realize RMC"));
-#else
-const bool UseSMT = false;
-#endif
 
-// The actual pass. It has a bogus setup routine and otherwise
-// calls out to RealizeRMC.
-class RealizeRMCPass : public FunctionPass {
+cl::opt<std::string> StatsJSON(
+  "rmc-stats-json",
+  cl::desc("Append a line of JSON with statistics about each function "
+           "to this file"),
+  cl::value_desc("filename"));
+
+cl::opt<bool> TimeReport(
+  "rmc-time-report",
+  cl::desc("Print how long each phase of RMC compilation took, in total "
+           "and for the slowest functions"));
+
+cl::opt<unsigned> Jobs(
+  "rmc-jobs",
+  cl::desc("Number of functions to analyze at the same time when using "
+           "SMT (0 means one per CPU)"),
+  cl::init(1));
+
+RMCTarget getTarget(Module &M) {
+  // Pull the platform out of the target triple
+  std::string triple = M.getTargetTriple();
+  if (triple.find("x86") == 0) {
+    return TargetX86;
+  } else if (triple.find("aarch64") == 0) {
+    return TargetARMv8;
+  } else if (triple.find("armv8") == 0) {
+    return TargetARMv8;
+  } else if (triple.find("arm") == 0) {
+    return TargetARM;
+  } else if (triple.find("powerpc") == 0) {
+    return TargetPOWER;
+  } else {
+    errs() << "Error: unsupported target '" << triple << "'\n";
+    rmc_error();
+    return TargetX86;
+  }
+}
+
+// Find the functions that have RMC annotations in them, by looking
+// at the calls to the __rmc_* functions, so that we can leave every
+// other function entirely alone.
+SmallPtrSet<Function *, 16> findRMCFunctions(Module &M) {
+  SmallPtrSet<Function *, 16> funcs;
+  for (auto &F : M) {
+    if (!F.isDeclaration() || !F.getName().startswith("__rmc_")) continue;
+    for (User *user : F.users()) {
+      CallInst *call = dyn_cast<CallInst>(user);
+      if (call && call->getCalledFunction() == &F) {
+        funcs.insert(call->getParent()->getParent());
+      }
+    }
+  }
+  return funcs;
+}
+
+// Does the function call any of the __rmc_* functions? This is the
+// per-function version of findRMCFunctions, for when we only get to
+// see one function at a time.
+bool usesRMC(Function &F) {
+  for (auto &block : F) {
+    for (auto &i : block) {
+      CallInst *call = dyn_cast<CallInst>(&i);
+      Function *target = call ? call->getCalledFunction() : nullptr;
+      if (target && target->isDeclaration() &&
+          target->getName().startswith("__rmc_")) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+// Module passes can only depend on per-function analyses, not on
+// per-function transformations like BreakCriticalEdges, so we break
+// critical edges ourselves (and the function pass does the same, so
+// that functions without RMC in them are left alone). The new blocks
+// go in splits, so that the ones we don't wind up using can be taken
+// back out. A function pass passes itself in to have its analyses
+// kept up to date; a module pass gets them afterwards.
+bool splitCriticalEdges(Function &F, SmallVectorImpl<BasicBlock *> &splits,
+                        Pass *pass = nullptr) {
+  for (auto &block : F) {
+    TerminatorInst *term = block.getTerminator();
+    for (unsigned i = 0; i < term->getNumSuccessors(); ++i) {
+      if (BasicBlock *split = splitCriticalEdge(term, i, pass)) {
+        splits.push_back(split);
+      }
+    }
+  }
+  return !splits.empty();
+}
+
+// Remove the blocks from splitting critical edges that we didn't put
+// anything in, so that we don't leave the function's layout any
+// worse than we found it.
+void unsplitCriticalEdges(ArrayRef<BasicBlock *> splits) {
+  for (BasicBlock *block : splits) {
+    BranchInst *br = dyn_cast<BranchInst>(block->getTerminator());
+    if (br && br->isUnconditional() && &block->front() == br) {
+      TryToSimplifyUncondBranchFromEmptyBlock(block);
+    }
+  }
+}
+
+void writeJSONString(std::ostream &os, StringRef str) {
+  os << '"';
+  for (char c : str) {
+    if (c == '"' || c == '\\') {
+      os << '\\' << c;
+    } else if ((unsigned char)c < 0x20) {
+      char buf[8];
+      snprintf(buf, sizeof(buf), "\\u%04x", c);
+      os << buf;
+    } else {
+      os << c;
+    }
+  }
+  os << '"';
+}
+
+// The phases that we time, by their names in reports
+struct TimedPhase {
+  const char *name;
+  double RMCStats::*time;
+};
+const TimedPhase kTimedPhases[] = {
+  { "prepare", &RMCStats::prepareTime },
+  { "find_actions", &RMCStats::findActionsTime },
+  { "action_graph", &RMCStats::actionGraphTime },
+  { "paths", &RMCStats::pathTime },
+  { "encode", &RMCStats::encodeTime },
+  { "solve", &RMCStats::solveTime },
+  { "apply", &RMCStats::applyTime },
+};
+
+// Totals of the phase times over a module, for -rmc-time-report
+class PhaseReport {
+public:
+  void add(Function &F, const RMCStats &stats) {
+    for (unsigned i = 0; i < array_lengthof(kTimedPhases); ++i) {
+      totals_[i] += stats.*kTimedPhases[i].time;
+    }
+    // The other phases happen during these ones.
+    double time = stats.prepareTime + stats.encodeTime + stats.solveTime +
+      stats.applyTime;
+    functions_.push_back(std::make_pair(time, F.getName().str()));
+  }
+
+  void print(raw_ostream &os) {
+    if (functions_.empty()) return;
+    os << "===" << std::string(73, '-') << "===\n"
+       << "                            RMC time report\n"
+       << "===" << std::string(73, '-') << "===\n"
+       << "  Total seconds for " << functions_.size() << " functions:\n";
+    for (unsigned i = 0; i < array_lengthof(kTimedPhases); ++i) {
+      os << format("  %10.4f  %s\n", totals_[i], kTimedPhases[i].name);
+    }
+
+    std::stable_sort(functions_.begin(), functions_.end(),
+                     [] (const std::pair<double, std::string> &a,
+                         const std::pair<double, std::string> &b) {
+                       return a.first > b.first;
+                     });
+    os << "  Slowest functions:\n";
+    for (unsigned i = 0; i < std::min<size_t>(functions_.size(), 10); ++i) {
+      os << format("  %10.4f  ", functions_[i].first)
+         << functions_[i].second << "\n";
+    }
+  }
+
+private:
+  double totals_[array_lengthof(kTimedPhases)] = {};
+  std::vector<std::pair<double, std::string>> functions_;
+};
+
+// Add the function's numbers to the -stats totals and, if there is
+// a json stream, write them out on a line of their own.
+void reportStats(Function &F, const RMCStats &stats, std::ostream *json) {
+  NumActions += stats.actions;
+  NumEdges += stats.edges;
+  NumPaths += stats.paths;
+  if (stats.solved) ++NumSMTFunctions;
+  if (stats.cached) ++NumSMTCached;
+  for (auto & vars : stats.smtVars) NumSMTVars += vars.second;
+  NumSMTAssertions += stats.smtAssertions;
+  NumSolverCalls += stats.solverCalls;
+
+  if (!json) return;
+  std::ostream &os = *json;
+  os << "{\"function\": ";
+  writeJSONString(os, F.getName());
+  os << ", \"actions\": " << stats.actions
+     << ", \"edges\": " << stats.edges
+     << ", \"paths\": " << stats.paths
+     << ", \"smt\": " << (stats.solved ? "true" : "false")
+     << ", \"cached\": " << (stats.cached ? "true" : "false");
+  if (stats.solved) {
+    os << ", \"vars\": {";
+    bool first = true;
+    for (auto & vars : stats.smtVars) {
+      if (!first) os << ", ";
+      first = false;
+      writeJSONString(os, vars.first);
+      os << ": " << vars.second;
+    }
+    os << "}, \"nodes\": " << stats.smtNodes
+       << ", \"assertions\": " << stats.smtAssertions
+       << ", \"solver_calls\": " << stats.solverCalls
+       << ", \"cost\": " << stats.cost
+       << ", \"optimal\": " << (stats.optimal ? "true" : "false");
+  }
+  os << ", \"time\": {";
+  for (unsigned i = 0; i < array_lengthof(kTimedPhases); ++i) {
+    if (i) os << ", ";
+    os << '"' << kTimedPhases[i].name << "\": " << stats.*kTimedPhases[i].time;
+  }
+  os << "}}\n";
+}
+
+// Open the -rmc-stats-json file for appending, if there is one.
+std::unique_ptr<std::ofstream> openStatsJSON() {
+  std::unique_ptr<std::ofstream> json;
+  if (!StatsJSON.empty()) {
+    json.reset(new std::ofstream(StatsJSON, std::ios::app));
+    if (!*json) {
+      errs() << "Error: can't open '" << StatsJSON << "'\n";
+      rmc_error();
+    }
+  }
+  return json;
+}
+
+// The actual pass. It works on the whole module so that the SMT
+// analysis of different functions can happen at the same time.
+// Everything that touches the IR happens one function at a time, on
+// this thread: we prepare each function in turn, analyze them all
+// in parallel, and then go back and insert the cuts.
+class RealizeRMCPass : public ModulePass {
 public:
   static char ID;
-  RealizeRMCPass() : FunctionPass(ID) { }
+  RealizeRMCPass() : ModulePass(ID) { }
   ~RealizeRMCPass() { }
 
-  virtual bool doInitialization(Module &M) override {
-    // Pull the platform out of the target triple and then sort of bogusly
-    // stick it in a global variable
-    std::string triple = M.getTargetTriple();
-    if (triple.find("x86") == 0) {
-      target = TargetX86;
-    } else if (triple.find("aarch64") == 0) {
-      target = TargetARMv8;
-    } else if (triple.find("armv8") == 0) {
-      target = TargetARMv8;
-    } else if (triple.find("arm") == 0) {
-      target = TargetARM;
-    } else if (triple.find("powerpc") == 0) {
-      target = TargetPOWER;
-    } else {
-      assert(false && "not given a supported target");
+  virtual bool runOnModule(Module &M) override {
+    // Most functions don't use RMC at all, and we don't want to pay
+    // for splitting their edges or computing their analyses.
+    auto rmcFuncs = findRMCFunctions(M);
+    if (rmcFuncs.empty()) return false;
+
+    RMCTarget target = getTarget(M);
+    unsigned jobs = Jobs ? Jobs : std::thread::hardware_concurrency();
+    bool parallel = UseSMT && jobs > 1;
+
+    std::unique_ptr<std::ofstream> json = openStatsJSON();
+    PhaseReport report;
+    bool changed = false;
+    std::vector<PendingFunction> pending;
+    for (auto &F : M) {
+      if (!rmcFuncs.count(&F)) continue;
+      SmallVector<BasicBlock *, 8> splits;
+      changed |= splitCriticalEdges(F, splits);
+      DominatorTree &dom =
+        getAnalysis<DominatorTreeWrapperPass>(F).getDomTree();
+      LoopInfo &li = getLoopInfo(*this, F);
+      std::unique_ptr<RealizeRMC> rmc(
+        new RealizeRMC(F, this, dom, li, UseSMT, target, &solutions_));
+      if (!rmc->prepare()) {
+        unsplitCriticalEdges(splits);
+        continue;
+      }
+      changed = true;
+      if (parallel) {
+        rmc->detachAnalyses();
+        pending.push_back({std::move(rmc), std::move(splits)});
+      } else {
+        rmc->analyze();
+        rmc->apply();
+        unsplitCriticalEdges(splits);
+        reportStats(F, rmc->stats(), json.get());
+        report.add(F, rmc->stats());
+      }
     }
-    return false;
-  }
-  virtual bool runOnFunction(Function &F) override {
-    // We, for unfortunate reasons that we should fix, depend on having
-    // proper names for basic blocks. Make sure we do.
-    bool discard = keepValueNames(F);
 
-    // Do the stuff
-    DominatorTree &dom = getAnalysis<DominatorTreeWrapperPass>().getDomTree();
-    LoopInfo &li = getLoopInfo(*this);
-    RealizeRMC rmc(F, this, dom, li, UseSMT, target);
-    bool res = rmc.run();
+    std::atomic<unsigned> next(0);
+    auto worker = [&] () {
+      unsigned i;
+      while ((i = next++) < pending.size()) {
+        pending[i].rmc->analyze();
+      }
+    };
+    std::vector<std::thread> threads;
+    for (unsigned i = 1; i < std::min<size_t>(jobs, pending.size()); ++i) {
+      threads.emplace_back(worker);
+    }
+    worker();
+    for (auto &thread : threads) thread.join();
+
+    for (auto &func : pending) {
+      RealizeRMC &rmc = *func.rmc;
+      rmc.apply();
+      unsplitCriticalEdges(func.splits);
+      reportStats(rmc.function(), rmc.stats(), json.get());
+      report.add(rmc.function(), rmc.stats());
+    }
+    if (TimeReport) report.print(errs());
 
-    restoreValueNames(F, discard);
-    return res;
+    return changed;
   }
 
   void getAnalysisUsage(AnalysisUsage &AU) const override {
-    AU.addRequiredID(BreakCriticalEdgesID);
     AU.addRequired<DominatorTreeWrapperPass>();
     AU.addRequired<LOOPINFO_PASS_NAME>();
   }
+
+private:
+  // A function waiting for its analysis to finish so we can apply it
+  struct PendingFunction {
+    std::unique_ptr<RealizeRMC> rmc;
+    SmallVector<BasicBlock *, 8> splits;
+  };
+
+  // So identical functions (template instantiations, mostly) only
+  // get solved once
+  SolutionCache solutions_;
 };
 
 char RealizeRMCPass::ID = 0;
@@ -1571,7 +2150,6 @@ namespace llvm { void initializeRealizeRMCPassPass(PassRegistry&); }
 // clang, but...
 INITIALIZE_PASS_BEGIN(RealizeRMCPass, "realize-rmc", "Compile RMC annotations",
                       false, false)
-INITIALIZE_PASS_DEPENDENCY(BreakCriticalEdges)
 // Hack to cause macro expansion of the name first...
 #define INITIALIZE_PASS_DEPENDENCY_X(x) INITIALIZE_PASS_DEPENDENCY(x)
 INITIALIZE_PASS_DEPENDENCY_X(LOOPINFO_PASS_NAME)
@@ -1579,29 +2157,108 @@ INITIALIZE_PASS_DEPENDENCY(DominatorTreeWrapperPass)
 INITIALIZE_PASS_END(RealizeRMCPass, "realize-rmc", "Compile RMC annotations",
                     false, false)
 
+// The same thing, a function at a time. With -rmc-jobs=1 (the
+// default) nothing gets analyzed at the same time anyway, and a
+// function pass can go in with the per-function simplification passes
+// that the inliner runs, where a module pass can't (see below).
+class RealizeRMCFunctionPass : public FunctionPass {
+public:
+  static char ID;
+  RealizeRMCFunctionPass() : FunctionPass(ID) { }
+  ~RealizeRMCFunctionPass() { }
+
+  virtual bool doFinalization(Module &M) override {
+    if (TimeReport) report_.print(errs());
+    report_ = PhaseReport();
+    json_.reset();
+    return false;
+  }
+
+  virtual bool runOnFunction(Function &F) override {
+    if (!usesRMC(F)) return false;
+    // Like the module pass, only look at the target and the stats
+    // file once there is something to do.
+    RMCTarget target = getTarget(*F.getParent());
+    if (!json_) json_ = openStatsJSON();
+
+    DominatorTree &dom = getAnalysis<DominatorTreeWrapperPass>().getDomTree();
+    LoopInfo &li = getLoopInfo(*this);
+    SmallVector<BasicBlock *, 8> splits;
+    bool changed = splitCriticalEdges(F, splits, this);
+    RealizeRMC rmc(F, this, dom, li, UseSMT, target, &solutions_);
+    if (rmc.run()) {
+      changed = true;
+      reportStats(F, rmc.stats(), json_.get());
+      report_.add(F, rmc.stats());
+    }
+    unsplitCriticalEdges(splits);
+    return changed;
+  }
+
+  void getAnalysisUsage(AnalysisUsage &AU) const override {
+    AU.addRequired<DominatorTreeWrapperPass>();
+    AU.addRequired<LOOPINFO_PASS_NAME>();
+  }
+
+private:
+  std::unique_ptr<std::ofstream> json_;
+  PhaseReport report_;
+  SolutionCache solutions_;
+};
+
+char RealizeRMCFunctionPass::ID = 0;
+
+namespace llvm { void initializeRealizeRMCFunctionPassPass(PassRegistry&); }
+
+INITIALIZE_PASS_BEGIN(RealizeRMCFunctionPass, "realize-rmc-function",
+                      "Compile RMC annotations, a function at a time",
+                      false, false)
+INITIALIZE_PASS_DEPENDENCY_X(LOOPINFO_PASS_NAME)
+INITIALIZE_PASS_DEPENDENCY(DominatorTreeWrapperPass)
+INITIALIZE_PASS_END(RealizeRMCFunctionPass, "realize-rmc-function",
+                    "Compile RMC annotations, a function at a time",
+                    false, false)
+
 // Dummy class so we can trigger our pass initialization with a static
 // initializer. We can't use RegisterPass because we need to be able
 // to specify dependencies.
 struct RMCInit {
-  RMCInit() { initializeRealizeRMCPassPass(*PassRegistry::getPassRegistry()); }
+  RMCInit() {
+    initializeRealizeRMCPassPass(*PassRegistry::getPassRegistry());
+    initializeRealizeRMCFunctionPassPass(*PassRegistry::getPassRegistry());
+  }
 } init;
 
 cl::opt<bool> DoRMC("rmc-pass",
                     cl::desc("Enable the RMC pass in the pass manager"));
 
+// We want to run after inlining and some basic optimizations, but
+// our markers inhibit code motion and so we want to let the optimizer
+// have a go afterwards. LoopOptimizerEnd seems like the earliest
+// place we can put it and have this work, so that is where the
+// function pass goes.
+//
+// LoopOptimizerEnd is in the per-function simplification passes that
+// the inliner runs on each SCC, though, and putting a module pass
+// there would split up the CGSCC pass manager and change the whole -O
+// pipeline. So when -rmc-jobs asks for functions to be analyzed in
+// parallel, the module pass goes at VectorizerStart instead: the
+// first module-level point after the inliner is all done, with
+// instcombine, simplifycfg and friends still to come after it.
+static void registerRMCFunctionPass(const PassManagerBuilder &,
+                                    legacy::PassManagerBase &PM) {
+  if (DoRMC && Jobs == 1) { PM.add(new RealizeRMCFunctionPass()); }
+}
+static RegisterStandardPasses
+    RegisterRMCFunction(PassManagerBuilder::EP_LoopOptimizerEnd,
+                        registerRMCFunctionPass);
+
 static void registerRMCPass(const PassManagerBuilder &,
                             legacy::PassManagerBase &PM) {
-  if (DoRMC) { PM.add(new RealizeRMCPass()); }
+  if (DoRMC && Jobs != 1) { PM.add(new RealizeRMCPass()); }
 }
-// LoopOptimizerEnd seems to be a fairly reasonable place to stick
-// this.  We want it after inlining and some basic optimizations, but
-// our markers inhibit code motion and so we want to let the optimizer
-// have a go afterwards.  LoopOptimizerEnd seems like the earliest
-// place we can put it and have this work.  An atrocious hack that
-// might be worth considering is putting it at EP_Peephole, which gets
-// called multiple times, and only doing it at the "right" one.
 static RegisterStandardPasses
-    RegisterRMC(PassManagerBuilder::EP_LoopOptimizerEnd,
+    RegisterRMC(PassManagerBuilder::EP_VectorizerStart,
                 registerRMCPass);
 
 // A very simple pass that deletes all of the dummy copies that RMC
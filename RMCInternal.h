@@ -7,16 +7,22 @@
 
 #include "sassert.h"
 
+#include <deque>
+#include <memory>
+#include <mutex>
 #include <utility>
 #include <tuple>
 
 #include "PathCache.h"
+#include "Timing.h"
 
 #include <llvm/ADT/DenseMap.h>
 #include <llvm/ADT/MapVector.h>
 #include <llvm/ADT/SetVector.h>
 #include <llvm/ADT/SmallPtrSet.h>
+#include <llvm/ADT/StringMap.h>
 #include <llvm/ADT/TinyPtrVector.h>
+#include <llvm/ADT/Twine.h>
 
 #include <llvm/IR/BasicBlock.h>
 #include <llvm/IR/Instructions.h>
@@ -81,9 +87,11 @@ enum ActionType {
 raw_ostream& operator<<(raw_ostream& os, const ActionType& t);
 struct Action {
   explicit
-  Action(BasicBlock *p_bb,
+  Action(unsigned p_id,
+         BasicBlock *p_bb,
          BasicBlock *p_outBlock,
          std::string p_name = "") :
+    id(p_id),
     bb(p_bb),
     outBlock(p_outBlock),
     name(p_name),
@@ -93,6 +101,9 @@ struct Action {
   Action(const Action &) = delete;
   Action(Action &&) = default; // move constructor!
 
+  // Actions are numbered densely, in the order they are made. The
+  // ActionGraph refers to them by these.
+  unsigned id;
   BasicBlock *bb;
   BasicBlock *outBlock;
 
@@ -109,29 +120,14 @@ struct Action {
   Value *outgoingDep{nullptr};
   Use *incomingDep{nullptr};
 
-  // Edges in the graph.
-
-  // For each outgoing edge, we need to store the binding site that
-  // the edge is associated with. It is possible, though not likely,
-  // that there will be multiple binding sites associated with the
-  // same target. To deal with this, the "set" of outgoing edges is
-  // actually a map from destination Action*s to a set of binding
-  // sites associated with edges to that action.
-
-  // As a binding site, null represents being bound outside of the
-  // function.
-  typedef SmallSetVector<BasicBlock *, 1> BindingSites;
-  // We use MapVector here so that when we iterate over the graph to
-  // produce an updated list of edges, we get a deterministic (if not
-  // particularly /useful/) ordering. This is important because the
-  // greedy non-SMT algorithm is sensitive to the ordering.
-  template <int N> using Edges = SmallMapVector<Action *, BindingSites, N>;
-  typedef Edges<2> OutEdges;
-  typedef Edges<8> TransEdges;
-
-  OutEdges edges[kNumEdgeTypes];
-  TransEdges transEdges[kNumEdgeTypes];
+  // Pre/post actions don't have a label, so go by their block
+  std::string debugName() const {
+    return name.empty() ? blockName(bb) : name;
+  }
 };
+// Actions live in a deque so that pointers to them stay good as
+// pre/post actions get added.
+typedef std::deque<Action> ActionList;
 
 //// Info about an RMC edge
 struct RMCEdge {
@@ -149,16 +145,107 @@ struct RMCEdge {
   }
 
   void print(raw_ostream &os) const {
-    // substr(5) is to drop "_rmc_" from the front
-    auto srcName = src ? src->bb->getName().substr(5) : "pre";
-    auto dstName = dst ? dst->bb->getName().substr(5) : "post";
-    auto bindName = bindSite ? bindSite->getName() : "<outside>";
+    auto srcName = src ? src->debugName() : "pre";
+    auto dstName = dst ? dst->debugName() : "post";
+    auto bindName = bindSite ? blockName(bindSite) : "<outside>";
     os << srcName << " -" << edgeType << "-> " << dstName <<
       " @ " << bindName;
   }
 };
 raw_ostream& operator<<(raw_ostream& os, const RMCEdge& e);
 
+//// The graph of the actions, with integer action ids, in compressed
+//// sparse row form.
+//
+// For each edge, we need to store the binding site that the edge is
+// associated with. It is possible, though not likely, that there
+// will be multiple binding sites associated with the same target, so
+// each edge has a list of them (in a side table, since there is
+// nearly always just one). As a binding site, null represents being
+// bound outside of the function.
+//
+// The edges out of each action stay in the order they were added, so
+// that when we iterate over the graph to produce an updated list of
+// edges, we get a deterministic (if not particularly /useful/)
+// ordering. This is important because the greedy non-SMT algorithm is
+// sensitive to the ordering.
+class ActionGraph {
+public:
+  struct Edge {
+    unsigned dst;
+    // The range of the edge's binding sites in the side table
+    unsigned bindBegin, bindEnd;
+  };
+
+  // A graph under construction, which can be added to
+  class Builder {
+  public:
+    struct Entry {
+      unsigned dst;
+      SmallVector<BasicBlock *, 1> bindSites;
+    };
+
+    explicit Builder(unsigned numActions);
+    // Add an edge, or, if there is one already, the binding site to it.
+    void add(RMCEdgeType type, unsigned src, unsigned dst,
+             BasicBlock *bindSite);
+    // Add an edge with all of entry's binding sites, unless there is
+    // one already.
+    void addIfMissing(RMCEdgeType type, unsigned src, const Entry &entry);
+    const Entry *find(RMCEdgeType type, unsigned src, unsigned dst) const {
+      auto i = index_[type].find(std::make_pair(src, dst));
+      return i == index_[type].end() ? nullptr : &rows_[type][src][i->second];
+    }
+    ArrayRef<Entry> row(RMCEdgeType type, unsigned src) const {
+      return rows_[type][src];
+    }
+    unsigned numActions() const { return rows_[0].size(); }
+    ActionGraph finish() const;
+
+  private:
+    std::vector<SmallVector<Entry, 2>> rows_[kNumEdgeTypes];
+    // Where each (src, dst) edge is in src's row
+    DenseMap<std::pair<unsigned, unsigned>, unsigned> index_[kNumEdgeTypes];
+  };
+
+  ActionGraph() : numActions_(0) {}
+
+  unsigned numActions() const { return numActions_; }
+  ArrayRef<Edge> edges(RMCEdgeType type, unsigned src) const {
+    return ArrayRef<Edge>(edges_[type]).slice(
+      rowStart_[type][src], rowStart_[type][src + 1] - rowStart_[type][src]);
+  }
+  ArrayRef<BasicBlock *> bindSites(const Edge &edge) const {
+    return ArrayRef<BasicBlock *>(bindSites_).slice(
+      edge.bindBegin, edge.bindEnd - edge.bindBegin);
+  }
+
+  // The graph with just the edges that keep(type, src, dst) says to
+  template <typename F> ActionGraph filter(F keep) const {
+    ActionGraph graph;
+    graph.numActions_ = numActions_;
+    graph.bindSites_ = bindSites_;
+    for (auto type : kEdgeTypes) {
+      graph.rowStart_[type].push_back(0);
+      for (unsigned src = 0; src < numActions_; ++src) {
+        for (const Edge &edge : edges(type, src)) {
+          if (keep(type, src, edge.dst)) graph.edges_[type].push_back(edge);
+        }
+        graph.rowStart_[type].push_back(graph.edges_[type].size());
+      }
+    }
+    return graph;
+  }
+
+private:
+  unsigned numActions_;
+  // The edges out of action i are edges_[rowStart_[i]] up to
+  // edges_[rowStart_[i+1]].
+  std::vector<unsigned> rowStart_[kNumEdgeTypes];
+  std::vector<Edge> edges_[kNumEdgeTypes];
+  std::vector<BasicBlock *> bindSites_;
+};
+
 //// Cuts in the graph
 enum CutType {
   CutNone,
@@ -212,24 +299,118 @@ bool branchesOn(BasicBlock *bb, Value *load,
 bool addrDepsOn(Use *use, Value *load,
                 PathCache *cache, BasicBlock *bindSite, PathID path,
                 std::vector<std::vector<Instruction *> > *trails = nullptr);
+bool addrDepsOn(Use *use, Value *load,
+                PathCache *cache, BasicBlock *bindSite,
+                const PathCache::PathRegion &region,
+                std::vector<std::vector<Instruction *> > *trails = nullptr);
 BasicBlock *getSingleSuccessor(BasicBlock *bb);
 
+// Relative execution frequencies of the CFG edges, including the
+// fictional edges from returns back to the entry block. Node
+// frequencies are crammed in with <block, nullptr> keys.
+typedef DenseMap<std::pair<BasicBlock *, BasicBlock *>, int> EdgeCapacities;
+EdgeCapacities computeCapacities(const LoopInfo &loops, Function &F);
+
+// A numbering of a function's blocks and values (arguments, then
+// instructions), for talking about them independently of the
+// particular function. Null gets -1.
+struct FuncNumbering {
+  explicit FuncNumbering(Function &F);
+
+  std::vector<BasicBlock *> blocks;
+  std::vector<Value *> values;
+  DenseMap<BasicBlock *, int> blockIDs;
+  DenseMap<Value *, int> valueIDs;
+
+  int block(BasicBlock *block) const {
+    auto it = blockIDs.find(block);
+    return it != blockIDs.end() ? it->second : -1;
+  }
+  int value(Value *value) const {
+    auto it = valueIDs.find(value);
+    return it != valueIDs.end() ? it->second : -1;
+  }
+};
+
+// Solutions to SMT problems, by a description of the problem that is
+// the same for identical functions (see SMTCache.cpp). They get kept
+// for the rest of the module, and on disk if -rmc-smt-cache-dir says
+// where. Functions being analyzed on different threads share one.
+class SolutionCache {
+public:
+  bool lookup(StringRef description, const FuncNumbering &num,
+              PathCache &pc, std::vector<EdgeCut> &cuts);
+  void store(StringRef description, const FuncNumbering &num,
+             PathCache &pc, const std::vector<EdgeCut> &cuts);
+
+private:
+  // The cuts, in the form that they are written to disk
+  StringMap<std::string> memo_;
+  std::mutex lock_;
+};
+
+// Numbers about how much work one function took, for -stats and
+// -rmc-stats-json. Times are in seconds.
+struct RMCStats {
+  unsigned actions{0};
+  unsigned edges{0};
+  unsigned paths{0};
+
+  // Whether the SMT solver was run, or the answer was remembered
+  bool solved{false};
+  bool cached{false};
+  // Variables by the name of the map they are for
+  std::vector<std::pair<std::string, unsigned>> smtVars;
+  unsigned smtNodes{0};
+  unsigned smtAssertions{0};
+  unsigned solverCalls{0};
+  uint64_t cost{0};
+  bool optimal{false};
+
+  // findActions and action graph time are part of prepare time, and
+  // path time (spent finding paths and regions in the PathCache) is
+  // part of whichever phase needed them.
+  double prepareTime{0};
+  double findActionsTime{0};
+  double actionGraphTime{0};
+  double pathTime{0};
+  double encodeTime{0};
+  double solveTime{0};
+  double applyTime{0};
+};
+
 // Class to track the analysis of the function and insert the syncs.
 class RealizeRMC {
 private:
   Function &func_;
   Pass * const underlyingPass_;
-  DominatorTree &domTree_;
-  LoopInfo &loopInfo_;
+  DominatorTree *domTree_;
+  LoopInfo *loopInfo_;
+  // Our own dominator tree, once we are detached from the pass's
+  std::unique_ptr<DominatorTree> ownDomTree_;
+  // Whether other functions are being analyzed at the same time
+  bool concurrent_{false};
   const bool useSMT_;
   const RMCTarget target_;
+  SolutionCache * const solutions_;
 
   int numNormalActions_{0};
-  std::vector<Action> actions_;
+  ActionList actions_;
   std::vector<RMCEdge> edges_;
+  // The transitive closure of the edges, less the useless ones
+  ActionGraph graph_;
   DenseMap<BasicBlock *, Action *> bb2action_;
   DenseMap<BasicBlock *, BlockCut> cuts_;
   PathCache pc_;
+  bool haveEdgeCaps_{false};
+  EdgeCapacities edgeCaps_;
+  std::vector<EdgeCut> smtCuts_;
+  // Whether the SMT solver gave up, leaving it to cutEdges()
+  bool smtGaveUp_{false};
+  // Remarks to emit when we get to apply(); LLVM's diagnostics can't
+  // be used from other threads.
+  std::vector<std::pair<BasicBlock *, std::string>> remarks_;
+  RMCStats stats_;
 
   // Functions
   BasicBlock *splitBlock(BasicBlock *Old, Instruction *SplitPt);
@@ -246,29 +427,60 @@ private:
   bool processPush(CallInst *call);
 
   // non-SMT compilation
-  CutStrength isPathCut(const RMCEdge &edge, PathID path,
-                        bool enforceSoft, bool justCheckCtrl);
+  const BlockCut *cutAt(BasicBlock *bb, bool isFront);
+  PathCache::PathRegion liveRegion(const RMCEdge &edge);
   CutStrength isEdgeCut(const RMCEdge &edge,
                         bool enforceSoft = false, bool justCheckCtrl = false);
   bool isCut(const RMCEdge &edge);
-  void cutEdge(RMCEdge &edge);
+  const EdgeCapacities &getEdgeCaps();
+  bool minCutEdge(const RMCEdge &edge, CutType type, bool dryRun = false);
+  void cutEdge(RMCEdge &edge, bool dryRun = false);
+  void sortEdgesForGreedy(std::vector<RMCEdge> &edges);
   void cutEdges();
+  DenseMap<BasicBlock *, BlockCut> greedyFences();
 
   // SMT compilation
   void insertCut(const EdgeCut &cut);
-  std::vector<EdgeCut> smtAnalyzeInner();
-  std::vector<EdgeCut> smtAnalyze();
+  // These return false if the solver ran out of time without finding
+  // any cuts. optimal is set if the cuts are known to be the best.
+  bool smtAnalyzeInner(std::vector<EdgeCut> &cuts, bool &optimal);
+  bool smtAnalyze(std::vector<EdgeCut> &cuts);
+  void describeProblem(raw_ostream &os, const FuncNumbering &num);
+
+  void remark(BasicBlock *where, const Twine &msg) {
+    remarks_.push_back(std::make_pair(where, msg.str()));
+  }
 
 public:
   RealizeRMC(Function &F, Pass *underlyingPass,
              DominatorTree &domTree,
              LoopInfo &loopInfo, bool useSMT,
-             RMCTarget target)
+             RMCTarget target, SolutionCache *solutions = nullptr)
     : func_(F), underlyingPass_(underlyingPass),
-      domTree_(domTree), loopInfo_(loopInfo),
-      useSMT_(useSMT), target_(target) {}
+      domTree_(&domTree), loopInfo_(&loopInfo),
+      useSMT_(useSMT), target_(target), solutions_(solutions) {}
   ~RealizeRMC() { }
   bool run();
+
+  // run() is these three in order. Only analyze() is safe to run on
+  // several functions at the same time; the other two change the IR
+  // (and the LLVMContext it lives in).
+  //
+  // prepare() finds the actions and edges, and returns false if there
+  // is nothing to do. analyze() works out what cuts to make, but only
+  // does anything when using SMT; the greedy algorithm is cheap and
+  // makes its cuts as it goes, in apply().
+  bool prepare();
+  void analyze();
+  void apply();
+  // Stop depending on the analyses we were given, which the pass
+  // manager will reuse for the next function. Only needed between
+  // prepare() and analyze(), when analyzing several functions at
+  // once.
+  void detachAnalyses();
+
+  Function &function() const { return func_; }
+  const RMCStats &stats() const { return stats_; }
 };
 
 }
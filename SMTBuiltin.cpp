@@ -0,0 +1,816 @@
+// Copyright (c) 2014-2017 Michael J. Sullivan
+// Use of this source code is governed by an MIT-style license that can be
+// found in the LICENSE file.
+
+// A small built-in backend for smt.h: a pseudo-Boolean optimizer, so
+// that we can find optimal cuts without Z3.
+//
+// Asserted formulas get Tseitin encoded into clauses and the
+// objective gets turned into a weight on each of a set of literals.
+// Then a CDCL SAT solver does branch-and-bound over it: whenever it
+// finds a solution it remembers it and restarts with the requirement
+// that anything else it finds be cheaper. Going over the bound is
+// treated as a conflict on the clause "not all of these expensive
+// literals", which gets learned from like any other conflict. When
+// the search space is exhausted, the last solution is optimal. If we
+// run out of time before that, the last solution is the best we have.
+// If we are given initial values for variables, the search follows
+// them until it finds its first solution.
+
+#include "smt.h"
+
+#include <llvm/Support/raw_ostream.h>
+
+#include <algorithm>
+#include <chrono>
+#include <exception>
+#include <sstream>
+#include <unordered_map>
+#include <utility>
+
+#undef NDEBUG
+#include <assert.h>
+
+using llvm::errs;
+
+namespace {
+
+// Literals are 2*var for the positive literal and 2*var+1 for the
+// negative one.
+typedef unsigned Lit;
+inline Lit mkLit(unsigned var, bool neg = false) { return 2*var + neg; }
+inline unsigned litVar(Lit l) { return l >> 1; }
+inline bool litNeg(Lit l) { return l & 1; }
+
+const int kNoReason = -1;
+// The reason for literals that are false because making them true
+// would go over the bound; the clause gets built if it is needed.
+const int kBoundReason = -2;
+const int kUndef = -1;
+
+typedef std::chrono::steady_clock Clock;
+
+class PBSolver {
+public:
+  PBSolver() {
+    // Variable 0 is always true.
+    trueLit_ = mkLit(newVar());
+    addClause({trueLit_});
+  }
+
+  Lit trueLit() const { return trueLit_; }
+
+  unsigned newVar() {
+    unsigned v = value_.size();
+    value_.push_back(kUndef);
+    level_.push_back(0);
+    reason_.push_back(kNoReason);
+    trailPos_.push_back(0);
+    activity_.push_back(0);
+    phase_.push_back(false);
+    seen_.push_back(false);
+    heapIndex_.push_back(-1);
+    weight_.push_back(0);
+    weight_.push_back(0);
+    watches_.emplace_back();
+    watches_.emplace_back();
+    heapInsert(v);
+    return v;
+  }
+
+  void addClause(std::vector<Lit> lits) {
+    assert(decisionLevel() == 0);
+    if (unsat_) return;
+    // Drop duplicates and false literals, and tautologies entirely.
+    std::sort(lits.begin(), lits.end());
+    size_t j = 0;
+    for (size_t i = 0; i < lits.size(); ++i) {
+      Lit l = lits[i];
+      if (litValue(l) == 1 || (j > 0 && lits[j-1] == (l ^ 1))) return;
+      if (litValue(l) == 0 || (j > 0 && lits[j-1] == l)) continue;
+      lits[j++] = l;
+    }
+    lits.resize(j);
+
+    if (lits.empty()) {
+      unsat_ = true;
+    } else if (lits.size() == 1) {
+      assign(lits[0], kNoReason);
+      if (propagate() != kNoReason) unsat_ = true;
+    } else {
+      attach(std::move(lits));
+    }
+  }
+
+  // Decide on l before anything else, until there is a solution.
+  void addHint(Lit l) { hints_.push_back(l); }
+
+  // Having l true costs w.
+  void addCost(Lit l, int64_t w) {
+    if (w < 0) {
+      offset_ += w;
+      l ^= 1; w = -w;
+    }
+    weight_[l] += w;
+    if (litValue(l) == 1) cost_ += w;
+  }
+  int64_t offset() const { return offset_; }
+
+  // Returns whether any solution was found. If so, bestCost() is
+  // optimal, unless we hit the deadline first.
+  bool solve(Clock::time_point deadline = Clock::time_point::max());
+  bool timedOut() const { return timedOut_; }
+  int64_t bestCost() const { return bestCost_ + offset_; }
+  bool bestValue(Lit l) const {
+    return model_[litVar(l)] != litNeg(l);
+  }
+
+private:
+  Lit trueLit_;
+  bool unsat_{false};
+
+  // Per variable
+  std::vector<int> value_;
+  std::vector<int> level_;
+  std::vector<int> reason_;
+  std::vector<unsigned> trailPos_;
+  std::vector<double> activity_;
+  std::vector<bool> phase_;
+  std::vector<bool> seen_;
+  // Per literal
+  std::vector<int64_t> weight_;
+  std::vector<std::vector<unsigned>> watches_;
+
+  std::vector<std::vector<Lit>> clauses_;
+  std::vector<Lit> trail_;
+  std::vector<size_t> trailLim_;
+  size_t qhead_{0};
+
+  // The cost of the literals currently true
+  int64_t cost_{0};
+  int64_t offset_{0};
+  bool haveBest_{false};
+  bool timedOut_{false};
+  int64_t bestCost_{0};
+  std::vector<bool> model_;
+  // The literals with a cost, most expensive first
+  std::vector<Lit> costly_;
+  // The ones that are currently true, in trail order
+  std::vector<Lit> costlyTrail_;
+  std::vector<Lit> boundReason_;
+  std::vector<Lit> hints_;
+  // Hints before this are all assigned
+  size_t nextHint_{0};
+
+  double activityInc_{1.0};
+
+  // A binary max-heap of the variables, by activity, for picking
+  // decisions.
+  std::vector<unsigned> heap_;
+  std::vector<int> heapIndex_;
+
+  int litValue(Lit l) const {
+    int v = value_[litVar(l)];
+    return v == kUndef ? kUndef : v ^ (int)litNeg(l);
+  }
+  int decisionLevel() const { return trailLim_.size(); }
+
+  void attach(std::vector<Lit> lits) {
+    unsigned ci = clauses_.size();
+    watches_[lits[0]].push_back(ci);
+    watches_[lits[1]].push_back(ci);
+    clauses_.push_back(std::move(lits));
+  }
+
+  void assign(Lit l, int reason) {
+    unsigned v = litVar(l);
+    value_[v] = !litNeg(l);
+    level_[v] = decisionLevel();
+    reason_[v] = reason;
+    trailPos_[v] = trail_.size();
+    if (weight_[l] > 0) {
+      cost_ += weight_[l];
+      costlyTrail_.push_back(l);
+    }
+    trail_.push_back(l);
+  }
+
+  void backtrack(int level) {
+    if (decisionLevel() <= level) return;
+    for (size_t i = trail_.size(); i > trailLim_[level]; --i) {
+      Lit l = trail_[i-1];
+      unsigned v = litVar(l);
+      if (weight_[l] > 0) {
+        cost_ -= weight_[l];
+        costlyTrail_.pop_back();
+      }
+      phase_[v] = !litNeg(l);
+      value_[v] = kUndef;
+      reason_[v] = kNoReason;
+      if (heapIndex_[v] < 0) heapInsert(v);
+    }
+    trail_.resize(trailLim_[level]);
+    trailLim_.resize(level);
+    qhead_ = trail_.size();
+    nextHint_ = 0;
+  }
+
+  int propagate();
+  bool propagateBound();
+  const std::vector<Lit> &explainBound(Lit p);
+  void analyze(const std::vector<Lit> &conflict,
+               std::vector<Lit> *learnt, int *backjumpLevel);
+  bool handleConflict(const std::vector<Lit> &conflict);
+  bool boundConflict();
+  bool decide();
+
+  void bump(unsigned v) {
+    if ((activity_[v] += activityInc_) > 1e100) {
+      for (auto &a : activity_) a *= 1e-100;
+      activityInc_ *= 1e-100;
+    }
+    if (heapIndex_[v] >= 0) heapUp(heapIndex_[v]);
+  }
+
+  bool heapLess(unsigned a, unsigned b) {
+    return activity_[a] > activity_[b];
+  }
+  void heapInsert(unsigned v) {
+    heapIndex_[v] = heap_.size();
+    heap_.push_back(v);
+    heapUp(heap_.size() - 1);
+  }
+  void heapUp(size_t i) {
+    unsigned v = heap_[i];
+    while (i > 0 && heapLess(v, heap_[(i-1)/2])) {
+      heap_[i] = heap_[(i-1)/2];
+      heapIndex_[heap_[i]] = i;
+      i = (i-1)/2;
+    }
+    heap_[i] = v;
+    heapIndex_[v] = i;
+  }
+  unsigned heapPop() {
+    unsigned top = heap_[0];
+    unsigned v = heap_.back();
+    heap_.pop_back();
+    heapIndex_[top] = -1;
+    if (heap_.empty()) return top;
+    size_t i = 0;
+    for (;;) {
+      size_t child = 2*i + 1;
+      if (child >= heap_.size()) break;
+      if (child + 1 < heap_.size() && heapLess(heap_[child+1], heap_[child]))
+        child++;
+      if (!heapLess(heap_[child], v)) break;
+      heap_[i] = heap_[child];
+      heapIndex_[heap_[i]] = i;
+      i = child;
+    }
+    heap_[i] = v;
+    heapIndex_[v] = i;
+    return top;
+  }
+};
+
+// Two watched literals. watches_[l] holds the clauses that are
+// watching l, which need looking at when l becomes false. The watched
+// literals are kept in the first two slots, and a clause that is the
+// reason for an assignment has the assigned literal first.
+int PBSolver::propagate() {
+  while (qhead_ < trail_.size()) {
+    Lit falseLit = trail_[qhead_++] ^ 1;
+    std::vector<unsigned> &ws = watches_[falseLit];
+    size_t i = 0, j = 0;
+    while (i < ws.size()) {
+      unsigned ci = ws[i++];
+      std::vector<Lit> &c = clauses_[ci];
+      if (c[0] == falseLit) std::swap(c[0], c[1]);
+      if (litValue(c[0]) == 1) {
+        ws[j++] = ci;
+        continue;
+      }
+      bool moved = false;
+      for (size_t k = 2; k < c.size(); ++k) {
+        if (litValue(c[k]) != 0) {
+          std::swap(c[1], c[k]);
+          watches_[c[1]].push_back(ci);
+          moved = true;
+          break;
+        }
+      }
+      if (moved) continue;
+
+      ws[j++] = ci;
+      if (litValue(c[0]) == 0) {
+        while (i < ws.size()) ws[j++] = ws[i++];
+        ws.resize(j);
+        qhead_ = trail_.size();
+        return ci;
+      }
+      assign(c[0], ci);
+    }
+    ws.resize(j);
+  }
+  return kNoReason;
+}
+
+// Anything that would cost enough to reach the bound by itself has
+// to be false. Returns whether that assigned anything.
+bool PBSolver::propagateBound() {
+  if (!haveBest_) return false;
+  bool assigned = false;
+  for (Lit l : costly_) {
+    if (cost_ + weight_[l] < bestCost_) break;
+    if (litValue(l) == kUndef) {
+      assign(l ^ 1, kBoundReason);
+      assigned = true;
+    }
+  }
+  return assigned;
+}
+
+// Build a reason clause for p having been assigned by
+// propagateBound: the costly literals that were true before it.
+const std::vector<Lit> &PBSolver::explainBound(Lit p) {
+  int64_t needed = bestCost_ - weight_[p ^ 1];
+  std::vector<std::pair<int64_t, Lit>> costly;
+  for (Lit l : costlyTrail_) {
+    if (trailPos_[litVar(l)] >= trailPos_[litVar(p)]) break;
+    costly.push_back(std::make_pair(weight_[l], l));
+  }
+  std::sort(costly.begin(), costly.end(),
+            [] (const std::pair<int64_t, Lit> &a,
+                const std::pair<int64_t, Lit> &b) {
+              return a.first > b.first;
+            });
+  boundReason_.clear();
+  boundReason_.push_back(p);
+  int64_t total = 0;
+  for (auto &entry : costly) {
+    if (total >= needed) break;
+    total += entry.first;
+    boundReason_.push_back(entry.second ^ 1);
+  }
+  return boundReason_;
+}
+
+// First-UIP conflict analysis. The conflict needs at least one
+// literal from the current decision level.
+void PBSolver::analyze(const std::vector<Lit> &conflict,
+                       std::vector<Lit> *learnt, int *backjumpLevel) {
+  learnt->clear();
+  learnt->push_back(0); // the UIP goes here
+  int pathCount = 0;
+  size_t index = trail_.size();
+  const std::vector<Lit> *lits = &conflict;
+  size_t start = 0;
+  Lit p = 0;
+
+  for (;;) {
+    for (size_t i = start; i < lits->size(); ++i) {
+      Lit q = (*lits)[i];
+      unsigned v = litVar(q);
+      if (seen_[v] || level_[v] == 0) continue;
+      seen_[v] = true;
+      bump(v);
+      if (level_[v] == decisionLevel()) {
+        pathCount++;
+      } else {
+        learnt->push_back(q);
+      }
+    }
+    // Find the next literal on the trail to look at
+    while (!seen_[litVar(trail_[--index])]) {}
+    p = trail_[index];
+    seen_[litVar(p)] = false;
+    if (--pathCount == 0) break;
+    int reason = reason_[litVar(p)];
+    lits = reason == kBoundReason ? &explainBound(p) : &clauses_[reason];
+    start = 1;
+  }
+  (*learnt)[0] = p ^ 1;
+
+  *backjumpLevel = 0;
+  for (size_t i = 1; i < learnt->size(); ++i) {
+    Lit q = (*learnt)[i];
+    seen_[litVar(q)] = false;
+    if (level_[litVar(q)] > *backjumpLevel) {
+      *backjumpLevel = level_[litVar(q)];
+      std::swap((*learnt)[1], (*learnt)[i]);
+    }
+  }
+  activityInc_ *= 1.05;
+}
+
+// Learn from a clause whose literals are all false. Returns false if
+// it is false at level 0, so the search is over.
+bool PBSolver::handleConflict(const std::vector<Lit> &conflict) {
+  int maxLevel = 0;
+  for (Lit l : conflict) maxLevel = std::max(maxLevel, level_[litVar(l)]);
+  if (maxLevel == 0) return false;
+  backtrack(maxLevel);
+
+  std::vector<Lit> learnt;
+  int level;
+  analyze(conflict, &learnt, &level);
+  backtrack(level);
+  if (learnt.size() == 1) {
+    assign(learnt[0], kNoReason);
+  } else {
+    Lit l = learnt[0];
+    attach(std::move(learnt));
+    assign(l, clauses_.size() - 1);
+  }
+  return true;
+}
+
+// If the literals currently true already cost as much as the best
+// solution, some of them have to go. Returns false if there is
+// nothing left to try.
+bool PBSolver::boundConflict() {
+  std::vector<std::pair<int64_t, Lit>> costly;
+  for (Lit l : costlyTrail_) {
+    costly.push_back(std::make_pair(weight_[l], l));
+  }
+  std::sort(costly.begin(), costly.end(),
+            [] (const std::pair<int64_t, Lit> &a,
+                const std::pair<int64_t, Lit> &b) {
+              return a.first > b.first;
+            });
+  // Use the most expensive literals that suffice, to keep the
+  // explanation short.
+  std::vector<Lit> conflict;
+  int64_t total = 0;
+  for (auto &entry : costly) {
+    if (total >= bestCost_) break;
+    total += entry.first;
+    conflict.push_back(entry.second ^ 1);
+  }
+  return handleConflict(conflict);
+}
+
+// Make a decision, or return false if everything is assigned.
+bool PBSolver::decide() {
+  while (!haveBest_ && nextHint_ < hints_.size()) {
+    Lit l = hints_[nextHint_++];
+    if (litValue(l) != kUndef) continue;
+    trailLim_.push_back(trail_.size());
+    assign(l, kNoReason);
+    return true;
+  }
+  while (!heap_.empty()) {
+    unsigned v = heapPop();
+    if (value_[v] != kUndef) continue;
+    // Try the cheaper polarity first; otherwise whatever it was last.
+    bool positive = phase_[v];
+    int64_t pos = weight_[mkLit(v)], neg = weight_[mkLit(v, true)];
+    if (pos != neg) positive = pos < neg;
+    trailLim_.push_back(trail_.size());
+    assign(mkLit(v, !positive), kNoReason);
+    return true;
+  }
+  return false;
+}
+
+// The Luby restart sequence: 1 1 2 1 1 2 4 1 1 2 ...
+double luby(unsigned i) {
+  unsigned size = 1, seq = 0;
+  while (size < i + 1) { seq++; size = 2*size + 1; }
+  while (size - 1 != i) {
+    size = (size - 1) / 2;
+    seq--;
+    i = i % size;
+  }
+  return 1u << seq;
+}
+
+bool PBSolver::solve(Clock::time_point deadline) {
+  if (unsat_) return false;
+  for (Lit l = 0; l < weight_.size(); ++l) {
+    if (weight_[l] > 0) costly_.push_back(l);
+  }
+  std::sort(costly_.begin(), costly_.end(),
+            [&] (Lit a, Lit b) { return weight_[a] > weight_[b]; });
+  // Start out deciding the variables with costs, which tend to
+  // determine everything else.
+  for (Lit l : costly_) bump(litVar(l));
+
+  const unsigned kRestartBase = 100;
+  unsigned restarts = 0, conflicts = 0;
+  unsigned restartLimit = kRestartBase * luby(restarts);
+  // Reading the clock isn't free, so only do it every so often.
+  const unsigned kClockInterval = 1024;
+  unsigned steps = 0;
+
+  for (;;) {
+    if (++steps % kClockInterval == 0 &&
+        deadline != Clock::time_point::max() && Clock::now() >= deadline) {
+      timedOut_ = true;
+      break;
+    }
+    int confl = propagate();
+    if (confl != kNoReason) {
+      conflicts++;
+      if (!handleConflict(clauses_[confl])) break;
+      continue;
+    }
+    if (haveBest_ && cost_ >= bestCost_) {
+      conflicts++;
+      if (!boundConflict()) break;
+      continue;
+    }
+    if (propagateBound()) continue;
+    if (conflicts >= restartLimit) {
+      conflicts = 0;
+      restartLimit = kRestartBase * luby(++restarts);
+      backtrack(0);
+      continue;
+    }
+    if (!decide()) {
+      // Found a solution. Remember it and go look for a better one.
+      haveBest_ = true;
+      bestCost_ = cost_;
+      model_.assign(value_.begin(), value_.end());
+      if (bestCost_ == 0) break;
+    }
+  }
+  backtrack(0);
+  return haveBest_;
+}
+
+// Encoding smt.h expressions into a PBSolver
+class Encoder {
+public:
+  Encoder(SmtContext &c, PBSolver &s) : c_(c), s_(s) {}
+
+  void assertTrue(unsigned id);
+  // Add cost * expr to the objective.
+  void addObjective(unsigned id, int64_t scale);
+  void addSoft(unsigned id, int64_t weight) {
+    s_.addCost(lit(id) ^ 1, weight);
+  }
+
+  Lit lit(unsigned id);
+  bool haveLit(unsigned id) const { return lits_.count(id); }
+
+  // Integer expressions, linearized: a constant plus weighted literals
+  struct Linear {
+    int64_t constant{0};
+    std::vector<std::pair<Lit, int64_t>> terms;
+  };
+  void linearize(unsigned id, int64_t scale, Linear *out);
+  const std::unordered_map<int64_t, Linear> &defs() const { return defs_; }
+
+private:
+  SmtContext &c_;
+  PBSolver &s_;
+  std::unordered_map<unsigned, Lit> lits_;
+  // Integer variables that have been defined, by variable index
+  std::unordered_map<int64_t, Linear> defs_;
+
+  void collectOr(unsigned id, std::vector<Lit> *out);
+};
+
+[[noreturn]] void unsupported(SmtContext &c, unsigned id) {
+  std::ostringstream buf;
+  buf << SmtExpr(c, id);
+  errs() << "Unsupported expression in the builtin SMT solver: "
+         << buf.str() << "\n";
+  std::terminate();
+}
+
+Lit Encoder::lit(unsigned id) {
+  auto it = lits_.find(id);
+  if (it != lits_.end()) return it->second;
+
+  const SmtNode &n = c_.node(id);
+  Lit l = 0;
+  if (n.op == SmtBoolVal) {
+    l = s_.trueLit() ^ !n.val;
+  } else if (n.op == SmtVar && n.isBool) {
+    l = mkLit(s_.newVar());
+  } else if (n.op == SmtNot) {
+    l = lit(n.args[0]) ^ 1;
+  } else if (n.op == SmtAnd || n.op == SmtOr) {
+    // An or is an and with everything negated
+    Lit neg = n.op == SmtOr;
+    Lit a = lit(n.args[0]) ^ neg, b = lit(n.args[1]) ^ neg;
+    Lit t = mkLit(s_.newVar());
+    s_.addClause({t ^ 1, a});
+    s_.addClause({t ^ 1, b});
+    s_.addClause({t, a ^ 1, b ^ 1});
+    l = t ^ neg;
+  } else if (n.op == SmtEq && n.isBool && c_.node(n.args[0]).isBool) {
+    Lit a = lit(n.args[0]), b = lit(n.args[1]);
+    Lit t = mkLit(s_.newVar());
+    s_.addClause({t ^ 1, a ^ 1, b});
+    s_.addClause({t ^ 1, a, b ^ 1});
+    s_.addClause({t, a, b});
+    s_.addClause({t, a ^ 1, b ^ 1});
+    l = t;
+  } else if (n.op == SmtIte && n.isBool) {
+    Lit cond = lit(n.args[0]), a = lit(n.args[1]), b = lit(n.args[2]);
+    Lit t = mkLit(s_.newVar());
+    s_.addClause({cond ^ 1, t ^ 1, a});
+    s_.addClause({cond ^ 1, t, a ^ 1});
+    s_.addClause({cond, t ^ 1, b});
+    s_.addClause({cond, t, b ^ 1});
+    l = t;
+  } else {
+    unsupported(c_, id);
+  }
+  lits_.insert(std::make_pair(id, l));
+  return l;
+}
+
+void Encoder::collectOr(unsigned id, std::vector<Lit> *out) {
+  const SmtNode &n = c_.node(id);
+  if (n.op == SmtOr && !lits_.count(id)) {
+    collectOr(n.args[0], out);
+    collectOr(n.args[1], out);
+  } else {
+    out->push_back(lit(id));
+  }
+}
+
+void Encoder::assertTrue(unsigned id) {
+  const SmtNode &n = c_.node(id);
+  if (n.op == SmtAnd) {
+    assertTrue(n.args[0]);
+    assertTrue(n.args[1]);
+  } else if (n.op == SmtOr) {
+    // Top level disjunctions can just be clauses.
+    std::vector<Lit> clause;
+    collectOr(id, &clause);
+    s_.addClause(std::move(clause));
+  } else if (n.op == SmtEq && !c_.node(n.args[0]).isBool) {
+    // Defining an integer variable
+    const SmtNode &var = c_.node(n.args[0]);
+    if (var.op != SmtVar || defs_.count(var.val)) unsupported(c_, id);
+    Linear def;
+    linearize(n.args[1], 1, &def);
+    defs_.insert(std::make_pair(var.val, std::move(def)));
+  } else {
+    s_.addClause({lit(id)});
+  }
+}
+
+void Encoder::linearize(unsigned id, int64_t scale, Linear *out) {
+  const SmtNode &n = c_.node(id);
+  if (n.op == SmtIntVal) {
+    out->constant += scale * n.val;
+  } else if (n.op == SmtVar) {
+    auto it = defs_.find(n.val);
+    if (it == defs_.end()) unsupported(c_, id);
+    out->constant += scale * it->second.constant;
+    for (auto &term : it->second.terms) {
+      out->terms.push_back(std::make_pair(term.first, scale * term.second));
+    }
+  } else if (n.op == SmtAdd) {
+    linearize(n.args[0], scale, out);
+    linearize(n.args[1], scale, out);
+  } else if (n.op == SmtMul) {
+    const SmtNode &a = c_.node(n.args[0]), &b = c_.node(n.args[1]);
+    if (a.op == SmtIntVal) {
+      linearize(n.args[1], scale * a.val, out);
+    } else if (b.op == SmtIntVal) {
+      linearize(n.args[0], scale * b.val, out);
+    } else {
+      unsupported(c_, id);
+    }
+  } else if (n.op == SmtIte) {
+    const SmtNode &a = c_.node(n.args[1]), &b = c_.node(n.args[2]);
+    if (a.op != SmtIntVal || b.op != SmtIntVal) unsupported(c_, id);
+    out->constant += scale * b.val;
+    if (a.val != b.val) {
+      out->terms.push_back(
+        std::make_pair(lit(n.args[0]), scale * (a.val - b.val)));
+    }
+  } else {
+    unsupported(c_, id);
+  }
+}
+
+void Encoder::addObjective(unsigned id, int64_t scale) {
+  Linear obj;
+  linearize(id, scale, &obj);
+  s_.addCost(s_.trueLit(), obj.constant);
+  for (auto &term : obj.terms) {
+    s_.addCost(term.first, term.second);
+  }
+}
+
+class BuiltinBackend : public SmtSolverImpl {
+public:
+  explicit BuiltinBackend(SmtContext &c) : c_(c) {}
+
+  void add(const SmtExpr &e) override { assertions_.push_back(e.id()); }
+  void push() override {
+    scopes_.push_back(Scope{assertions_.size(), objective_.size(),
+                            soft_.size()});
+  }
+  void pop() override {
+    assert(!scopes_.empty());
+    Scope &scope = scopes_.back();
+    assertions_.resize(scope.assertions);
+    objective_.resize(scope.objective);
+    soft_.resize(scope.soft);
+    scopes_.pop_back();
+  }
+  void minimize(const SmtExpr &e) override { objective_.push_back(e.id()); }
+  void add_soft(const SmtExpr &e, smt_uint weight) override {
+    soft_.push_back(std::make_pair(e.id(), (int64_t)weight));
+  }
+  void set_timeout(unsigned ms) override { timeout_ = ms; }
+  void set_initial_value(const SmtExpr &var, bool value) override {
+    hints_.push_back(std::make_pair(var.id(), value));
+  }
+
+  SmtResult check() override;
+  SmtModel get_model() override {
+    assert(haveModel_);
+    return SmtModel(c_, model_);
+  }
+  smt_uint lower() override { return lower_; }
+  smt_uint upper() override { return cost_; }
+  // Branch and bound does the minimizing in one search.
+  unsigned solver_calls() override { return checks_; }
+
+  void print(std::ostream &os) override {
+    for (unsigned id : assertions_) {
+      os << SmtExpr(c_, id) << "\n";
+    }
+    for (unsigned id : objective_) {
+      os << "(minimize " << SmtExpr(c_, id) << ")\n";
+    }
+    for (auto &soft : soft_) {
+      os << "(soft " << SmtExpr(c_, soft.first) << " "
+         << soft.second << ")\n";
+    }
+  }
+
+private:
+  SmtContext &c_;
+  struct Scope {
+    size_t assertions, objective, soft;
+  };
+  std::vector<unsigned> assertions_;
+  std::vector<unsigned> objective_;
+  std::vector<std::pair<unsigned, int64_t>> soft_;
+  std::vector<Scope> scopes_;
+  std::vector<std::pair<unsigned, bool>> hints_;
+  unsigned timeout_{0};
+
+  bool haveModel_{false};
+  std::vector<int64_t> model_;
+  smt_uint cost_{0};
+  smt_uint lower_{0};
+  unsigned checks_{0};
+};
+
+// We aren't incremental; every check() builds the problem from
+// scratch. That's fine, since we only check once per problem anyways.
+SmtResult BuiltinBackend::check() {
+  ++checks_;
+  PBSolver s;
+  Encoder enc(c_, s);
+  for (unsigned id : assertions_) enc.assertTrue(id);
+  for (unsigned id : objective_) enc.addObjective(id, 1);
+  for (auto &soft : soft_) enc.addSoft(soft.first, soft.second);
+  // Variables that didn't make it into the problem don't matter.
+  for (auto &hint : hints_) {
+    if (enc.haveLit(hint.first)) s.addHint(enc.lit(hint.first) ^ !hint.second);
+  }
+
+  Clock::time_point deadline = Clock::time_point::max();
+  if (timeout_) deadline = Clock::now() + std::chrono::milliseconds(timeout_);
+  haveModel_ = s.solve(deadline);
+  if (!haveModel_) return s.timedOut() ? SmtUnknown : SmtUnsat;
+  cost_ = s.bestCost();
+  // Branch and bound doesn't prove anything about the optimum until
+  // it is done, except that it can't be less than the constant part.
+  lower_ = s.timedOut() ? std::max<int64_t>(s.offset(), 0) : cost_;
+
+  model_.assign(c_.numVars(), 0);
+  for (unsigned var = 0; var < c_.numVars(); ++var) {
+    unsigned id = c_.varNode(var);
+    if (enc.haveLit(id)) {
+      model_[var] = s.bestValue(enc.lit(id));
+    }
+  }
+  for (auto &entry : enc.defs()) {
+    int64_t val = entry.second.constant;
+    for (auto &term : entry.second.terms) {
+      if (s.bestValue(term.first)) val += term.second;
+    }
+    model_[entry.first] = val;
+  }
+  return SmtSat;
+}
+
+}
+
+std::unique_ptr<SmtSolverImpl> makeBuiltinSolver(SmtContext &c) {
+  return std::unique_ptr<SmtSolverImpl>(new BuiltinBackend(c));
+}
@@ -0,0 +1,402 @@
+// Copyright (c) 2014-2017 Michael J. Sullivan
+// Use of this source code is governed by an MIT-style license that can be
+// found in the LICENSE file.
+
+// A cache of SMT solutions. Code that uses RMC tends to live in
+// headers and templates, so the same functions get compiled (and the
+// same SMT problems solved) over and over: for each instantiation of
+// a template, in every translation unit that includes them, on every
+// build. We describe the problem in a way that doesn't depend on
+// anything that varies between those (names of values, blocks and
+// types, debug info, the module around the function) and use that to
+// look up the list of cuts that got inserted last time, first in
+// memory and then, if we have been given a directory, on disk
+// (hashed).
+//
+// Cuts are stored in terms of a numbering of the function's blocks
+// and values, which is why the description needs to pin down the
+// function body exactly (well, everything except those names; nothing
+// in the analysis looks at them). That means the structure of types,
+// and everything about an instruction that isn't an operand, too: two
+// functions that differ only in which field an extractvalue takes can
+// have entirely different dependencies. Globals do keep their names,
+// since which function gets called is exactly what the analysis looks
+// at (the __rmc_* ones, say), so two instantiations that call
+// different instantiations of something else still won't match.
+
+#include "RMCInternal.h"
+
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/Function.h>
+#include <llvm/IR/InlineAsm.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/IntrinsicInst.h>
+#include <llvm/IR/Operator.h>
+#include <llvm/Support/CommandLine.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/MD5.h>
+
+#include <fstream>
+#include <sstream>
+
+#undef NDEBUG
+#include <assert.h>
+
+using namespace llvm;
+
+// Bump this whenever the description or the file format changes.
+static const int kCacheVersion = 3;
+
+static cl::opt<std::string> SMTCacheDir(
+  "rmc-smt-cache-dir",
+  cl::desc("Directory in which to cache SMT solutions between builds"));
+
+FuncNumbering::FuncNumbering(Function &F) {
+  for (auto &arg : F.args()) {
+    valueIDs[&arg] = values.size();
+    values.push_back(&arg);
+  }
+  for (auto &block : F) {
+    blockIDs[&block] = blocks.size();
+    blocks.push_back(&block);
+    // Debug info shouldn't change anything, so don't count it.
+    for (auto &i : block) {
+      if (isa<DbgInfoIntrinsic>(i)) continue;
+      valueIDs[&i] = values.size();
+      values.push_back(&i);
+    }
+  }
+}
+
+//// Describing problems
+
+static void describeOperand(raw_ostream &os, const FuncNumbering &num,
+                            Value *v) {
+  if (!v) {
+    os << "null";
+  } else if (auto *block = dyn_cast<BasicBlock>(v)) {
+    os << "b" << num.block(block);
+  } else if (num.valueIDs.count(v)) {
+    os << "v" << num.value(v);
+  } else if (auto *iasm = dyn_cast<InlineAsm>(v)) {
+    os << "asm(\"" << iasm->getAsmString() << "\", \""
+       << iasm->getConstraintString() << "\", "
+       << iasm->hasSideEffects() << ")";
+  } else if (auto *c = dyn_cast<Constant>(v)) {
+    c->printAsOperand(os, false);
+  } else {
+    // Metadata, pretty much.
+    os << "?";
+  }
+}
+
+// Types get described by their structure rather than printed, since
+// a named struct prints as its name, and the name is often the only
+// thing that differs between instantiations of a template
+// (%"class.Queue<int>" and %"class.Queue<long>", say, laid out the
+// same). Structs can point to themselves, so each one gets a number
+// the first time it shows up and is just that number after.
+typedef DenseMap<StructType *, unsigned> StructNumbering;
+
+static void describeType(raw_ostream &os, StructNumbering &structs,
+                         Type *type) {
+  if (auto *st = dyn_cast<StructType>(type)) {
+    auto it = structs.find(st);
+    if (it != structs.end()) {
+      os << "s" << it->second;
+      return;
+    }
+    unsigned id = structs.size();
+    structs[st] = id;
+    os << "s" << id;
+    if (st->isOpaque()) {
+      os << " opaque";
+      return;
+    }
+    os << (st->isPacked() ? " <{" : " {");
+    for (unsigned n = 0; n < st->getNumElements(); ++n) {
+      if (n > 0) os << ", ";
+      describeType(os, structs, st->getElementType(n));
+    }
+    os << (st->isPacked() ? "}>" : "}");
+  } else if (auto *pt = dyn_cast<PointerType>(type)) {
+    describeType(os, structs, pt->getElementType());
+    if (pt->getAddressSpace()) {
+      os << " addrspace(" << pt->getAddressSpace() << ")";
+    }
+    os << "*";
+  } else if (auto *at = dyn_cast<ArrayType>(type)) {
+    os << "[" << at->getNumElements() << " x ";
+    describeType(os, structs, at->getElementType());
+    os << "]";
+  } else if (auto *vt = dyn_cast<VectorType>(type)) {
+    os << "<" << vt->getNumElements() << " x ";
+    describeType(os, structs, vt->getElementType());
+    os << ">";
+  } else if (auto *ft = dyn_cast<FunctionType>(type)) {
+    describeType(os, structs, ft->getReturnType());
+    os << " (";
+    for (unsigned n = 0; n < ft->getNumParams(); ++n) {
+      if (n > 0) os << ", ";
+      describeType(os, structs, ft->getParamType(n));
+    }
+    if (ft->isVarArg()) os << (ft->getNumParams() ? ", ..." : "...");
+    os << ")";
+  } else {
+    // Nothing else has a name or anything inside it.
+    type->print(os);
+  }
+}
+
+template <typename T>
+static void describeIndices(raw_ostream &os, const T *inst) {
+  for (unsigned idx : inst->getIndices()) {
+    os << " " << idx;
+  }
+}
+
+// Calls and invokes both have these, but not through a common base.
+template <typename T>
+static void describeCall(raw_ostream &os, const T *call) {
+  typedef decltype(call->getAttributes()) Attrs;
+  Attrs attrs = call->getAttributes();
+  os << " cc" << call->getCallingConv()
+     << " [" << attrs.getAsString(Attrs::FunctionIndex)
+     << "] [" << attrs.getAsString(Attrs::ReturnIndex) << "]";
+  for (unsigned n = 0; n < call->getNumArgOperands(); ++n) {
+    os << " [" << attrs.getAsString(n + 1) << "]";
+  }
+}
+
+static void describeInstruction(raw_ostream &os, const FuncNumbering &num,
+                                StructNumbering &structs, Instruction &i) {
+  os << i.getOpcodeName() << " ";
+  describeType(os, structs, i.getType());
+  if (auto *op = dyn_cast<OverflowingBinaryOperator>(&i)) {
+    os << " " << op->hasNoUnsignedWrap() << op->hasNoSignedWrap();
+  } else if (auto *op = dyn_cast<PossiblyExactOperator>(&i)) {
+    os << " " << op->isExact();
+  }
+  if (auto *cmp = dyn_cast<CmpInst>(&i)) {
+    os << " p" << (int)cmp->getPredicate();
+  } else if (auto *load = dyn_cast<LoadInst>(&i)) {
+    os << " " << load->isVolatile() << (int)load->getOrdering();
+  } else if (auto *store = dyn_cast<StoreInst>(&i)) {
+    os << " " << store->isVolatile() << (int)store->getOrdering();
+  } else if (auto *rmw = dyn_cast<AtomicRMWInst>(&i)) {
+    os << " " << rmw->isVolatile() << (int)rmw->getOperation()
+       << (int)rmw->getOrdering();
+  } else if (auto *cas = dyn_cast<AtomicCmpXchgInst>(&i)) {
+    os << " " << cas->isVolatile() << cas->isWeak()
+       << (int)cas->getSuccessOrdering() << (int)cas->getFailureOrdering();
+  } else if (auto *fence = dyn_cast<FenceInst>(&i)) {
+    os << " " << (int)fence->getOrdering();
+  } else if (auto *alloca = dyn_cast<AllocaInst>(&i)) {
+    os << " ";
+    describeType(os, structs, alloca->getAllocatedType());
+    os << " " << alloca->getAlignment();
+  } else if (auto *gep = dyn_cast<GetElementPtrInst>(&i)) {
+    os << " " << gep->isInBounds();
+  } else if (auto *extract = dyn_cast<ExtractValueInst>(&i)) {
+    describeIndices(os, extract);
+  } else if (auto *insert = dyn_cast<InsertValueInst>(&i)) {
+    describeIndices(os, insert);
+  } else if (auto *call = dyn_cast<CallInst>(&i)) {
+    os << " " << (int)call->getTailCallKind();
+    describeCall(os, call);
+  } else if (auto *invoke = dyn_cast<InvokeInst>(&i)) {
+    describeCall(os, invoke);
+  } else if (auto *landingPad = dyn_cast<LandingPadInst>(&i)) {
+    os << " " << landingPad->isCleanup();
+  }
+
+  // Operands get their types, since a constant's doesn't otherwise
+  // show up anywhere (and for GEPs and loads the pointer's type is
+  // what says what they index or load).
+  for (auto &op : i.operands()) {
+    os << " ";
+    describeOperand(os, num, op);
+    if (!isa<BasicBlock>(op)) {
+      os << ":";
+      describeType(os, structs, op->getType());
+    }
+  }
+  if (auto *phi = dyn_cast<PHINode>(&i)) {
+    for (auto *block : phi->blocks()) {
+      os << " b" << num.block(block);
+    }
+  }
+
+  // Profile data goes into the edge weights.
+  if (MDNode *prof = i.getMetadata(LLVMContext::MD_prof)) {
+    os << " !prof";
+    for (unsigned n = 1; n < prof->getNumOperands(); ++n) {
+#if LLVM_VERSION_MAJOR == 3 && LLVM_VERSION_MINOR == 5
+      auto *weight = dyn_cast<ConstantInt>(prof->getOperand(n));
+#else
+      auto *weight = mdconst::dyn_extract<ConstantInt>(prof->getOperand(n));
+#endif
+      os << " " << (weight ? weight->getZExtValue() : 0);
+    }
+  }
+  os << "\n";
+}
+
+void RealizeRMC::describeProblem(raw_ostream &os,
+                                 const FuncNumbering &num) {
+  os << "rmc-smt-cache " << kCacheVersion << "\n";
+  os << "target " << target_ << " paths " << pc_.pathBudget() << "\n";
+
+  StructNumbering structs;
+  for (auto *block : num.blocks) {
+    os << "b" << num.block(block) << ":\n";
+    for (auto &i : *block) {
+      if (!num.valueIDs.count(&i)) continue;
+      os << "  v" << num.value(&i) << " = ";
+      describeInstruction(os, num, structs, i);
+    }
+  }
+
+  for (auto &action : actions_) {
+    os << "action " << action.id << " " << action.type
+       << " b" << num.block(action.bb) << " b" << num.block(action.outBlock)
+       << " " << action.allSC << " out ";
+    describeOperand(os, num, action.outgoingDep);
+    os << " in ";
+    if (action.incomingDep) {
+      describeOperand(os, num, action.incomingDep->getUser());
+      os << "." << action.incomingDep->getOperandNo();
+    } else {
+      os << "null";
+    }
+    os << "\n";
+    for (auto edgeType : kEdgeTypes) {
+      for (auto &edge : graph_.edges(edgeType, action.id)) {
+        os << "  " << edgeType << " " << edge.dst << " @";
+        for (auto *bindSite : graph_.bindSites(edge)) {
+          os << " b" << num.block(bindSite);
+        }
+        os << "\n";
+      }
+    }
+  }
+}
+
+//// Reading and writing cuts
+
+// One cut per line: type, src, dst, read, binding site, and then the
+// blocks of the path. Missing things are -1.
+static void writeCuts(raw_ostream &os, const FuncNumbering &num,
+                      PathCache &pc, const std::vector<EdgeCut> &cuts) {
+  for (auto &cut : cuts) {
+    os << cut.type << " " << num.block(cut.src) << " " << num.block(cut.dst)
+       << " " << num.value(cut.read) << " " << num.block(cut.bindSite);
+    for (auto *block : pc.extractPath(cut.path)) {
+      os << " " << num.block(block);
+    }
+    os << "\n";
+  }
+}
+
+static bool readCuts(std::istream &is, const FuncNumbering &num,
+                     PathCache &pc, std::vector<EdgeCut> &cuts) {
+  auto getBlock = [&] (int id, BasicBlock *&block) {
+    if (id < -1 || id >= (int)num.blocks.size()) return false;
+    block = id < 0 ? nullptr : num.blocks[id];
+    return true;
+  };
+
+  std::string line;
+  while (std::getline(is, line)) {
+    std::istringstream ls(line);
+    int type, src, dst, read, bindSite;
+    if (!(ls >> type >> src >> dst >> read >> bindSite)) return false;
+    if (type <= CutNone || type > CutAcquire) return false;
+    if (read < -1 || read >= (int)num.values.size()) return false;
+
+    EdgeCut cut;
+    cut.type = (CutType)type;
+    cut.read = read < 0 ? nullptr : num.values[read];
+    if (!getBlock(src, cut.src) || !getBlock(dst, cut.dst) ||
+        !getBlock(bindSite, cut.bindSite)) {
+      return false;
+    }
+
+    SmallVector<BasicBlock *, 8> path;
+    int id;
+    while (ls >> id) {
+      BasicBlock *block;
+      if (!getBlock(id, block) || !block) return false;
+      path.push_back(block);
+    }
+    cut.path = pc.makePath(path);
+    cuts.push_back(cut);
+  }
+  return true;
+}
+
+static std::string cacheFile(StringRef dir, StringRef description) {
+  MD5 hash;
+  hash.update(description);
+  MD5::MD5Result result;
+  hash.final(result);
+  SmallString<32> hex;
+  MD5::stringifyResult(result, hex);
+  return (dir + "/" + hex + ".cuts").str();
+}
+
+bool SolutionCache::lookup(StringRef description, const FuncNumbering &num,
+                           PathCache &pc, std::vector<EdgeCut> &cuts) {
+  {
+    std::lock_guard<std::mutex> guard(lock_);
+    auto it = memo_.find(description);
+    if (it != memo_.end()) {
+      std::istringstream is(it->second);
+      bool ok = readCuts(is, num, pc, cuts);
+      assert(ok);
+      return true;
+    }
+  }
+  if (SMTCacheDir.empty()) return false;
+
+  std::string path = cacheFile(SMTCacheDir, description);
+  std::ifstream is(path);
+  if (!is) return false;
+  if (!readCuts(is, num, pc, cuts)) {
+    errs() << "Ignoring a corrupt SMT cache entry: " << path << "\n";
+    cuts.clear();
+    return false;
+  }
+  return true;
+}
+
+void SolutionCache::store(StringRef description, const FuncNumbering &num,
+                          PathCache &pc, const std::vector<EdgeCut> &cuts) {
+  std::string text;
+  raw_string_ostream os(text);
+  writeCuts(os, num, pc, cuts);
+  os.flush();
+  {
+    std::lock_guard<std::mutex> guard(lock_);
+    memo_[description] = text;
+  }
+  if (SMTCacheDir.empty()) return;
+
+  // Write it somewhere else and move it into place, so that builds
+  // running in parallel never see half of a file.
+  std::string path = cacheFile(SMTCacheDir, description);
+  SmallString<128> tmpPath;
+  int fd;
+  if (sys::fs::create_directories(SMTCacheDir) ||
+      sys::fs::createUniqueFile(path + ".tmp-%%%%%%", fd, tmpPath)) {
+    errs() << "Couldn't write to the SMT cache in " << SMTCacheDir << "\n";
+    return;
+  }
+  {
+    raw_fd_ostream file(fd, true);
+    file << text;
+  }
+  if (sys::fs::rename(tmpPath, path)) {
+    sys::fs::remove(tmpPath);
+  }
+}
@@ -0,0 +1,252 @@
+// Copyright (c) 2014-2017 Michael J. Sullivan
+// Use of this source code is governed by an MIT-style license that can be
+// found in the LICENSE file.
+
+// The backend-independent part of smt.h: building, printing, and
+// evaluating expressions.
+
+#include "smt.h"
+
+#include <unordered_map>
+#include <utility>
+
+SmtContext::SmtContext() {
+  make(SmtBoolVal, true, 0, 0, 0, 0);
+  make(SmtBoolVal, true, 0, 0, 0, 1);
+}
+
+unsigned SmtContext::make(SmtOp op, bool isBool,
+                          unsigned a, unsigned b, unsigned c,
+                          int64_t val) {
+  NodeKey key;
+  if (op != SmtVar) {
+    // Sort the arguments of the commutative things, for more sharing.
+    if ((op == SmtAnd || op == SmtOr || op == SmtEq ||
+         op == SmtAdd || op == SmtMul) && a > b) {
+      std::swap(a, b);
+    }
+    key = NodeKey(op, a, b, c, val);
+    auto it = uniq_.find(key);
+    if (it != uniq_.end()) return it->second;
+  }
+
+  SmtNode n;
+  n.op = op;
+  n.isBool = isBool;
+  n.args[0] = a; n.args[1] = b; n.args[2] = c;
+  n.val = val;
+  nodes_.push_back(n);
+  unsigned id = nodes_.size() - 1;
+  if (op != SmtVar) uniq_.insert(std::make_pair(key, id));
+  return id;
+}
+
+SmtSort SmtContext::bool_sort() { return SmtSort(*this, true); }
+SmtSort SmtContext::int_sort() { return SmtSort(*this, false); }
+
+SmtExpr SmtContext::bool_val(bool b) {
+  return SmtExpr(*this, b ? kTrue : kFalse);
+}
+SmtExpr SmtContext::int_val(int64_t i) {
+  return SmtExpr(*this, make(SmtIntVal, false, 0, 0, 0, i));
+}
+
+SmtExpr SmtContext::constant(const char *name, const SmtSort &sort) {
+  unsigned id = make(SmtVar, sort.is_bool(), 0, 0, 0, vars_.size());
+  vars_.push_back(id);
+  names_.push_back(name);
+  fresh_.push_back(false);
+  return SmtExpr(*this, id);
+}
+SmtExpr SmtContext::fresh_constant(const char *prefix, const SmtSort &sort) {
+  SmtExpr e = constant(prefix, sort);
+  fresh_.back() = true;
+  return e;
+}
+SmtExpr SmtContext::bool_const(const char *name) {
+  return constant(name, bool_sort());
+}
+SmtExpr SmtContext::int_const(const char *name) {
+  return constant(name, int_sort());
+}
+
+std::string SmtContext::varName(unsigned var) const {
+  if (!fresh_[var]) return names_[var];
+  return names_[var] + "!" + std::to_string(var);
+}
+
+//// Building expressions, folding constants as we go.
+
+static SmtExpr mk(const SmtExpr &a, SmtOp op, bool isBool,
+                  unsigned x, unsigned y = 0, unsigned z = 0) {
+  SmtContext &c = a.ctx();
+  return SmtExpr(c, c.make(op, isBool, x, y, z));
+}
+
+SmtExpr operator!(const SmtExpr &a) {
+  assert(a.is_bool());
+  if (a.node().op == SmtBoolVal) return a.ctx().bool_val(!a.node().val);
+  if (a.node().op == SmtNot) return SmtExpr(a.ctx(), a.node().args[0]);
+  return mk(a, SmtNot, true, a.id());
+}
+
+SmtExpr operator&&(const SmtExpr &a, const SmtExpr &b) {
+  assert(a.is_bool() && b.is_bool());
+  if (a.isBoolVal(false) || b.isBoolVal(true)) return a;
+  if (b.isBoolVal(false) || a.isBoolVal(true)) return b;
+  if (a.id() == b.id()) return a;
+  return mk(a, SmtAnd, true, a.id(), b.id());
+}
+
+SmtExpr operator||(const SmtExpr &a, const SmtExpr &b) {
+  assert(a.is_bool() && b.is_bool());
+  if (a.isBoolVal(true) || b.isBoolVal(false)) return a;
+  if (b.isBoolVal(true) || a.isBoolVal(false)) return b;
+  if (a.id() == b.id()) return a;
+  return mk(a, SmtOr, true, a.id(), b.id());
+}
+
+SmtExpr implies(const SmtExpr &a, const SmtExpr &b) {
+  return !a || b;
+}
+
+SmtExpr operator==(const SmtExpr &a, const SmtExpr &b) {
+  assert(a.is_bool() == b.is_bool());
+  SmtContext &c = a.ctx();
+  if (a.id() == b.id()) return c.bool_val(true);
+  if (a.is_bool()) {
+    if (a.node().op == SmtBoolVal) return a.node().val ? b : !b;
+    if (b.node().op == SmtBoolVal) return b.node().val ? a : !a;
+  } else if (a.isIntVal() && b.isIntVal()) {
+    return c.bool_val(a.node().val == b.node().val);
+  }
+  return mk(a, SmtEq, true, a.id(), b.id());
+}
+
+SmtExpr ite(const SmtExpr &cond, const SmtExpr &a, const SmtExpr &b) {
+  assert(cond.is_bool() && a.is_bool() == b.is_bool());
+  if (cond.node().op == SmtBoolVal) return cond.node().val ? a : b;
+  if (a.id() == b.id()) return a;
+  if (a.isIntVal() && b.isIntVal() && a.node().val == b.node().val) return a;
+  return mk(cond, SmtIte, a.is_bool(), cond.id(), a.id(), b.id());
+}
+
+SmtExpr operator+(const SmtExpr &a, const SmtExpr &b) {
+  assert(!a.is_bool() && !b.is_bool());
+  if (a.isIntVal() && b.isIntVal()) {
+    return a.ctx().int_val(a.node().val + b.node().val);
+  }
+  if (a.isIntVal() && a.node().val == 0) return b;
+  if (b.isIntVal() && b.node().val == 0) return a;
+  return mk(a, SmtAdd, false, a.id(), b.id());
+}
+
+SmtExpr operator*(const SmtExpr &a, const SmtExpr &b) {
+  assert(!a.is_bool() && !b.is_bool());
+  if (a.isIntVal() && b.isIntVal()) {
+    return a.ctx().int_val(a.node().val * b.node().val);
+  }
+  if (a.isIntVal() && a.node().val == 1) return b;
+  if (b.isIntVal() && b.node().val == 1) return a;
+  return mk(a, SmtMul, false, a.id(), b.id());
+}
+
+SmtExpr operator<=(const SmtExpr &a, const SmtExpr &b) {
+  assert(!a.is_bool() && !b.is_bool());
+  if (a.isIntVal() && b.isIntVal()) {
+    return a.ctx().bool_val(a.node().val <= b.node().val);
+  }
+  return mk(a, SmtLe, true, a.id(), b.id());
+}
+
+SmtExpr operator<(const SmtExpr &a, const SmtExpr &b) {
+  assert(!a.is_bool() && !b.is_bool());
+  if (a.isIntVal() && b.isIntVal()) {
+    return a.ctx().bool_val(a.node().val < b.node().val);
+  }
+  return mk(a, SmtLt, true, a.id(), b.id());
+}
+
+//// Printing, in something like SMT-LIB syntax
+
+static void printNode(std::ostream &os, SmtContext &c, unsigned id) {
+  const SmtNode &n = c.node(id);
+  const char *name = nullptr;
+  int arity = 2;
+  switch (n.op) {
+  case SmtBoolVal: os << (n.val ? "true" : "false"); return;
+  case SmtIntVal: os << n.val; return;
+  case SmtVar: os << "|" << c.varName(n.val) << "|"; return;
+  case SmtNot: name = "not"; arity = 1; break;
+  case SmtAnd: name = "and"; break;
+  case SmtOr: name = "or"; break;
+  case SmtEq: name = "="; break;
+  case SmtIte: name = "ite"; arity = 3; break;
+  case SmtAdd: name = "+"; break;
+  case SmtMul: name = "*"; break;
+  case SmtLe: name = "<="; break;
+  case SmtLt: name = "<"; break;
+  }
+  os << "(" << name;
+  for (int i = 0; i < arity; i++) {
+    os << " ";
+    printNode(os, c, n.args[i]);
+  }
+  os << ")";
+}
+
+std::ostream &operator<<(std::ostream &os, const SmtExpr &e) {
+  printNode(os, e.ctx(), e.id());
+  return os;
+}
+
+//// Models
+
+typedef std::unordered_map<unsigned, int64_t> EvalMemo;
+static int64_t evalNode(const SmtModel &model, SmtContext &c, unsigned id,
+                        EvalMemo &memo) {
+  const SmtNode &n = c.node(id);
+  if (n.op == SmtBoolVal || n.op == SmtIntVal) return n.val;
+  if (n.op == SmtVar) return model.varValue(n.val);
+
+  auto it = memo.find(id);
+  if (it != memo.end()) return it->second;
+  auto arg = [&] (int i) { return evalNode(model, c, n.args[i], memo); };
+  int64_t v = 0;
+  switch (n.op) {
+  case SmtNot: v = !arg(0); break;
+  case SmtAnd: v = arg(0) && arg(1); break;
+  case SmtOr: v = arg(0) || arg(1); break;
+  case SmtEq: v = arg(0) == arg(1); break;
+  case SmtIte: v = arg(0) ? arg(1) : arg(2); break;
+  case SmtAdd: v = arg(0) + arg(1); break;
+  case SmtMul: v = arg(0) * arg(1); break;
+  case SmtLe: v = arg(0) <= arg(1); break;
+  case SmtLt: v = arg(0) < arg(1); break;
+  default: assert(false && "impossible");
+  }
+  memo[id] = v;
+  return v;
+}
+
+int64_t SmtModel::value(const SmtExpr &e) const {
+  EvalMemo memo;
+  return evalNode(*this, *c_, e.id(), memo);
+}
+
+SmtExpr SmtModel::eval(const SmtExpr &e) const {
+  int64_t v = value(e);
+  return e.is_bool() ? c_->bool_val(v != 0) : c_->int_val(v);
+}
+
+void SmtModel::print(std::ostream &os) const {
+  for (unsigned i = 0; i < c_->numVars(); ++i) {
+    os << c_->varName(i) << " = ";
+    if (c_->node(c_->varNode(i)).isBool) {
+      os << (varValue(i) ? "true" : "false");
+    } else {
+      os << varValue(i);
+    }
+    os << "\n";
+  }
+}
@@ -0,0 +1,346 @@
+// Copyright (c) 2014-2017 Michael J. Sullivan
+// Use of this source code is governed by an MIT-style license that can be
+// found in the LICENSE file.
+
+// Splitting problems into independent parts. The problem for a
+// function often falls apart into pieces that don't share any
+// variables (edges in unrelated parts of the function, like the
+// enqueue and dequeue halves of an inlined queue), and several small
+// problems are much cheaper to solve than one big one. They can also
+// be solved at the same time.
+//
+// We just record what we are given and, when asked to check, group
+// the assertions, the terms of the objective, and the soft
+// constraints by which variables they (transitively) share, and then
+// hand each group to a fresh solver of its own. Since the groups
+// share no variables, the sum of their optimal costs is optimal.
+
+#include "smt.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+namespace {
+
+// Union-find over variable indexes
+class VarSets {
+public:
+  explicit VarSets(unsigned n) : parent_(n) {
+    for (unsigned i = 0; i < n; ++i) parent_[i] = i;
+  }
+  unsigned find(unsigned v) {
+    while (parent_[v] != v) {
+      parent_[v] = parent_[parent_[v]];
+      v = parent_[v];
+    }
+    return v;
+  }
+  void join(unsigned a, unsigned b) { parent_[find(a)] = find(b); }
+private:
+  std::vector<unsigned> parent_;
+};
+
+int arity(const SmtNode &n) {
+  switch (n.op) {
+  case SmtBoolVal: case SmtIntVal: case SmtVar: return 0;
+  case SmtNot: return 1;
+  case SmtIte: return 3;
+  default: return 2;
+  }
+}
+
+class SplittingSolver : public SmtSolverImpl {
+public:
+  SplittingSolver(SmtContext &c, SmtBackend backend, unsigned threads)
+    : c_(c), backend_(backend), threads_(std::max(threads, 1u)) {}
+
+  void add(const SmtExpr &e) override { assertions_.push_back(e.id()); }
+  void push() override {
+    scopes_.push_back(Scope{assertions_.size(), objective_.size(),
+                            soft_.size()});
+  }
+  void pop() override {
+    assert(!scopes_.empty());
+    Scope &scope = scopes_.back();
+    assertions_.resize(scope.assertions);
+    objective_.resize(scope.objective);
+    soft_.resize(scope.soft);
+    scopes_.pop_back();
+  }
+  // The objective gets split into the terms of the sum so that each
+  // part only gets the terms that mention its variables.
+  void minimize(const SmtExpr &e) override {
+    std::vector<unsigned> stack{e.id()};
+    while (!stack.empty()) {
+      const SmtNode &n = c_.node(stack.back());
+      if (n.op == SmtAdd) {
+        stack.pop_back();
+        stack.push_back(n.args[0]);
+        stack.push_back(n.args[1]);
+      } else {
+        objective_.push_back(stack.back());
+        stack.pop_back();
+      }
+    }
+  }
+  void add_soft(const SmtExpr &e, smt_uint weight) override {
+    soft_.push_back(std::make_pair(e.id(), weight));
+  }
+  void set_timeout(unsigned ms) override { timeout_ = ms; }
+  void set_initial_value(const SmtExpr &var, bool value) override {
+    hints_.push_back(std::make_pair(var.id(), value));
+  }
+
+  SmtResult check() override;
+  SmtModel get_model() override { return SmtModel(c_, model_); }
+  smt_uint lower() override { return lower_; }
+  smt_uint upper() override { return upper_; }
+  unsigned solver_calls() override { return calls_; }
+
+  void print(std::ostream &os) override {
+    for (unsigned id : assertions_) {
+      os << SmtExpr(c_, id) << "\n";
+    }
+    for (unsigned id : objective_) {
+      os << "(minimize " << SmtExpr(c_, id) << ")\n";
+    }
+    for (auto &soft : soft_) {
+      os << "(soft " << SmtExpr(c_, soft.first) << " " << soft.second << ")\n";
+    }
+  }
+
+private:
+  SmtContext &c_;
+  SmtBackend backend_;
+  unsigned threads_;
+  // The time limit covers all of the parts together.
+  typedef std::chrono::steady_clock Clock;
+  unsigned timeout_{0};
+  Clock::time_point deadline_;
+
+  struct Scope {
+    size_t assertions, objective, soft;
+  };
+  std::vector<unsigned> assertions_;
+  std::vector<unsigned> objective_;
+  std::vector<std::pair<unsigned, smt_uint>> soft_;
+  std::vector<Scope> scopes_;
+  std::vector<std::pair<unsigned, bool>> hints_;
+
+  std::vector<int64_t> model_;
+  smt_uint lower_{0}, upper_{0};
+  std::atomic<unsigned> calls_{0};
+
+  // One independent part of the problem
+  struct Part {
+    std::vector<unsigned> assertions;
+    std::vector<unsigned> objective;
+    std::vector<std::pair<unsigned, smt_uint>> soft;
+    std::vector<std::pair<unsigned, bool>> hints;
+    std::vector<unsigned> vars;
+
+    SmtResult result{SmtUnknown};
+    smt_uint lower{0}, upper{0};
+
+    size_t size() const {
+      return assertions.size() + objective.size() + soft.size();
+    }
+  };
+  void solvePart(Part &part);
+  void fallBackToHints(Part &part);
+};
+
+SmtResult SplittingSolver::check() {
+  // Only look at the nodes we were actually given. The context also
+  // has everything else that was ever built in it -- in particular
+  // the partial sums the objective was built up from, which mention
+  // every variable and would glue all the parts back together.
+  std::vector<bool> used(c_.numNodes(), false);
+  std::vector<unsigned> stack(assertions_);
+  stack.insert(stack.end(), objective_.begin(), objective_.end());
+  for (auto &soft : soft_) stack.push_back(soft.first);
+  while (!stack.empty()) {
+    unsigned id = stack.back();
+    stack.pop_back();
+    if (used[id]) continue;
+    used[id] = true;
+    const SmtNode &n = c_.node(id);
+    for (int i = 0; i < arity(n); ++i) stack.push_back(n.args[i]);
+  }
+
+  // Find a variable standing for the group of each node, joining the
+  // groups of its arguments. Nodes are only ever made after their
+  // arguments, so one pass in order does it.
+  const int kNone = -1;
+  VarSets sets(c_.numVars());
+  std::vector<int> varOf(c_.numNodes(), kNone);
+  for (unsigned id = 0; id < c_.numNodes(); ++id) {
+    if (!used[id]) continue;
+    const SmtNode &n = c_.node(id);
+    if (n.op == SmtVar) {
+      varOf[id] = n.val;
+      continue;
+    }
+    for (int i = 0; i < arity(n); ++i) {
+      int var = varOf[n.args[i]];
+      if (var == kNone) continue;
+      if (varOf[id] == kNone) {
+        varOf[id] = var;
+      } else {
+        sets.join(var, varOf[id]);
+      }
+    }
+  }
+
+  // Everything that mentions the same variables goes in the same
+  // part. Things with no variables at all get a part of their own.
+  std::vector<Part> parts;
+  std::vector<int> partOf(c_.numVars() + 1, kNone);
+  auto part = [&] (unsigned id) -> Part & {
+    int var = varOf[id];
+    unsigned key = var == kNone ? c_.numVars() : sets.find(var);
+    if (partOf[key] == kNone) {
+      partOf[key] = parts.size();
+      parts.emplace_back();
+    }
+    return parts[partOf[key]];
+  };
+  for (unsigned id : assertions_) part(id).assertions.push_back(id);
+  for (unsigned id : objective_) part(id).objective.push_back(id);
+  for (auto &soft : soft_) part(soft.first).soft.push_back(soft);
+  for (unsigned var = 0; var < c_.numVars(); ++var) {
+    int p = partOf[sets.find(var)];
+    if (p != kNone) parts[p].vars.push_back(var);
+  }
+  for (auto &hint : hints_) {
+    int p = partOf[sets.find(c_.node(hint.first).val)];
+    if (p != kNone) parts[p].hints.push_back(hint);
+  }
+  // Each part fills in the values of its own variables.
+  model_.assign(c_.numVars(), 0);
+
+  // Do the big ones first, so that one doesn't get left until the
+  // end while everybody else waits.
+  std::vector<unsigned> order(parts.size());
+  for (unsigned i = 0; i < parts.size(); ++i) order[i] = i;
+  std::stable_sort(order.begin(), order.end(), [&] (unsigned a, unsigned b) {
+    return parts[a].size() > parts[b].size();
+  });
+
+  deadline_ = Clock::now() + std::chrono::milliseconds(timeout_);
+  std::atomic<unsigned> next(0);
+  auto worker = [&] () {
+    unsigned i;
+    while ((i = next++) < order.size()) {
+      solvePart(parts[order[i]]);
+    }
+  };
+  unsigned numThreads = std::min<size_t>(threads_, parts.size());
+  std::vector<std::thread> threads;
+  for (unsigned i = 1; i < numThreads; ++i) {
+    threads.emplace_back(worker);
+  }
+  worker();
+  for (auto &thread : threads) thread.join();
+
+  // The big parts go first and share the deadline, so a part can be
+  // left with no time to find anything. Rather than throw away the
+  // parts that did get solved over that, take the initial values we
+  // were given for it. (If nothing got solved, the caller can do
+  // better than the initial values on its own.)
+  bool anySolved = std::any_of(parts.begin(), parts.end(), [] (Part &part) {
+    return part.result == SmtSat;
+  });
+  if (timeout_ && anySolved) {
+    for (auto &part : parts) {
+      if (part.result == SmtUnknown) fallBackToHints(part);
+    }
+  }
+
+  // Put the answers back together.
+  lower_ = upper_ = 0;
+  SmtResult result = SmtSat;
+  for (auto &part : parts) {
+    if (part.result != SmtSat) {
+      if (part.result == SmtUnsat || result == SmtSat) result = part.result;
+      continue;
+    }
+    lower_ += part.lower;
+    upper_ += part.upper;
+  }
+  return result;
+}
+
+// This runs on a worker thread. The context is shared, but nothing
+// in here adds to it, and different parts write to different
+// variables in the model.
+void SplittingSolver::solvePart(Part &part) {
+  SmtSolver s(c_, backend_);
+  if (timeout_) {
+    auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+      deadline_ - Clock::now()).count();
+    s.set_timeout(std::max<long long>(left, 1));
+  }
+  for (unsigned id : part.assertions) s.add(SmtExpr(c_, id));
+  for (unsigned id : part.objective) s.minimize(SmtExpr(c_, id));
+  for (auto &soft : part.soft) s.add_soft(SmtExpr(c_, soft.first), soft.second);
+  for (auto &hint : part.hints) {
+    s.set_initial_value(SmtExpr(c_, hint.first), hint.second);
+  }
+
+  part.result = s.check();
+  calls_ += s.solver_calls();
+  if (part.result != SmtSat) return;
+  part.lower = s.lower();
+  part.upper = s.upper();
+  SmtModel model = s.get_model();
+  for (unsigned var : part.vars) {
+    model_[var] = model.varValue(var);
+  }
+}
+
+// Solve a part that ran out of time again, with the initial values
+// as assertions instead of suggestions and nothing to optimize, which
+// just leaves filling in the rest of the variables. This adds to the
+// context, so it must not run alongside anything else.
+void SplittingSolver::fallBackToHints(Part &part) {
+  if (part.hints.empty()) return;
+  SmtSolver s(c_, backend_);
+  auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+    deadline_ - Clock::now()).count();
+  s.set_timeout(std::max<long long>(left, timeout_ / 10 + 1));
+  for (unsigned id : part.assertions) s.add(SmtExpr(c_, id));
+  for (auto &hint : part.hints) {
+    SmtExpr var(c_, hint.first);
+    s.add(hint.second ? var : !var);
+  }
+  SmtResult result = s.check();
+  calls_ += s.solver_calls();
+  if (result != SmtSat) return;
+
+  // We know nothing about how good this is, just what it costs.
+  SmtModel model = s.get_model();
+  part.result = SmtSat;
+  part.lower = 0;
+  part.upper = 0;
+  for (unsigned id : part.objective) {
+    part.upper += model.value(SmtExpr(c_, id));
+  }
+  for (auto &soft : part.soft) {
+    if (!model.value(SmtExpr(c_, soft.first))) part.upper += soft.second;
+  }
+  for (unsigned var : part.vars) {
+    model_[var] = model.varValue(var);
+  }
+}
+
+}
+
+std::unique_ptr<SmtSolverImpl> makeSplittingSolver(SmtContext &c,
+                                                   SmtBackend backend,
+                                                   unsigned threads) {
+  return std::unique_ptr<SmtSolverImpl>(
+    new SplittingSolver(c, backend, threads));
+}
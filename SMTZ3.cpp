@@ -0,0 +1,490 @@
+// Copyright (c) 2014-2017 Michael J. Sullivan
+// Use of this source code is governed by an MIT-style license that can be
+// found in the LICENSE file.
+
+// The Z3 backend for smt.h. We translate our expressions into Z3's as
+// they get asserted.
+
+#if USE_Z3
+
+#include "smt.h"
+
+#include <z3++.h>
+
+#include <llvm/Support/raw_ostream.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+
+#undef NDEBUG
+#include <assert.h>
+
+using llvm::errs;
+
+namespace {
+
+// Some tuning parameters for when we have to do the minimizing
+// ourselves.
+
+// Should we pick the initial upper bound by seeing what the solver
+// produces without constraints instead of by binary searching up?
+const bool kGuessUpperBound = true;
+const int kFirstUpperBound = 16;
+// If we guess an upper bound, should we hope that it is optimal and
+// check the bound - 1 before we binary search?
+const bool kCheckFirstGuess = false;
+
+#if USE_Z3_OPTIMIZER
+typedef z3::optimize Z3Solver;
+#else
+typedef z3::solver Z3Solver;
+#endif
+
+template <typename F>
+auto guard(F f) -> decltype(f()) {
+  try {
+    return f();
+  } catch (z3::exception &e) {
+    errs() << "Unexpected Z3 error: " << e.msg() << "\n";
+    std::terminate();
+  }
+}
+
+typedef std::chrono::steady_clock Clock;
+const Clock::time_point kNoDeadline = Clock::time_point::max();
+
+// Check, giving up at the deadline, and count it in calls
+z3::check_result z3Check(Z3Solver &s, Clock::time_point deadline,
+                         unsigned &calls,
+                         const z3::expr_vector *assumptions = nullptr) {
+  ++calls;
+  if (deadline != kNoDeadline) {
+    auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+      deadline - Clock::now()).count();
+    z3::params p(s.ctx());
+    p.set("timeout", (unsigned)std::max<long long>(left, 1));
+    s.set(p);
+  }
+  return assumptions ? s.check(*assumptions) : s.check();
+}
+
+int64_t z3Int(z3::context &c, const z3::expr &e) {
+  int64_t i;
+  auto b = Z3_get_numeral_int64(c, e, &i);
+  assert(b == Z3_TRUE);
+  return i;
+}
+
+// Code for optimizing by hand
+// FIXME: should we try to use some sort of bigint?
+typedef smt_uint Cost;
+
+// Generic binary search over a monotonic predicate
+typedef std::function<bool (Cost)> CostPred;
+
+// Given a monotonic predicate, find the first value in [lo, hi]
+// for which it holds. It needs to hold for hi.
+Cost findFirstTrue(CostPred pred, Cost lo, Cost hi) {
+  if (lo >= hi) return hi;
+  Cost mid = lo + (hi - lo) / 2; // funny to avoid overflow
+
+  if (pred(mid)) {
+    return findFirstTrue(pred, lo, mid);
+  } else {
+    return findFirstTrue(pred, mid + 1, hi);
+  }
+}
+
+// Given a monotonic predicate pred that is not always false, find the
+// lowest value c for which pred(c) is true.
+Cost findFirstTrue(CostPred pred) {
+  Cost lo = 0, hi = kFirstUpperBound;
+
+  // Search upwards to find some value for which pred(c) holds.
+  while (!pred(hi)) {
+    lo = hi + 1;
+    hi *= 2;
+    assert(hi != 0); // fail if we overflow
+  }
+
+  return findFirstTrue(pred, lo, hi);
+}
+
+// Given a solver and an expression, find a solution that minimizes
+// the expression through repeated calls to the solver. If we run out
+// of time, we settle for the best solution so far. The model goes in
+// best, and lo and hi get what we know about the minimum. If there is
+// a model satisfying hints, we start from it. calls counts the
+// checks.
+z3::check_result handMinimize(Z3Solver &s, z3::expr &costVar,
+                              const z3::expr_vector &hints,
+                              Clock::time_point deadline, unsigned &calls,
+                              std::unique_ptr<z3::model> &best,
+                              Cost &lo, Cost &hi) {
+  lo = hi = 0;
+  bool outOfTime = false;
+  auto foundModel = [&] () {
+    Cost cost = z3Int(s.ctx(), s.get_model().eval(costVar, true));
+    if (!best || cost < hi) {
+      best.reset(new z3::model(s.get_model()));
+      hi = cost;
+    }
+  };
+  // Once we are out of time, we pretend that everything is under, so
+  // that the searches finish right away.
+  auto costPred = [&] (Cost cost) {
+    if (outOfTime) return true;
+    s.push();
+    s.add(costVar <= s.ctx().int_val((uint64_t)cost));
+    z3::check_result result = z3Check(s, deadline, calls);
+    if (result == z3::sat) {
+      foundModel();
+    } else if (result == z3::unsat) {
+      lo = std::max(lo, cost + 1);
+    } else {
+      outOfTime = true;
+    }
+    s.pop();
+
+    errs() << "Trying cost " << cost << ": " << (result == z3::sat) << "\n";
+    return result != z3::unsat;
+  };
+
+  // Our costs are big numbers, so starting from a good solution saves
+  // a lot of searching for the right range.
+  if (!hints.empty() && z3Check(s, deadline, calls, &hints) == z3::sat) {
+    foundModel();
+  } else if (kGuessUpperBound) {
+    // This is in theory arbitrarily worse but might be better in
+    // practice. Although the cost is bounded by the number of things
+    // we could do, so...
+    z3::check_result result = z3Check(s, deadline, calls);
+    if (result != z3::sat) return result;
+    foundModel();
+    errs() << "Upper bound: " << hi << "\n";
+  } else {
+    findFirstTrue(costPred);
+    return best ? z3::sat : outOfTime ? z3::unknown : z3::unsat;
+  }
+
+  // The solver seems to often "just happen" to find the optimal
+  // solution, so maybe do a quick check on upperBound-1
+  if (kCheckFirstGuess && hi > 0 && !costPred(hi - 1)) {
+    // It was.
+  } else {
+    // Binary search, except that the models we find are often well
+    // under the bound we asked for, and their costs are better bounds.
+    while (lo < hi && !outOfTime) {
+      costPred(lo + (hi - lo) / 2);
+    }
+  }
+  return best ? z3::sat : outOfTime ? z3::unknown : z3::unsat;
+}
+
+// Z3 contexts take a while to set up and, once they have done some
+// work, a *long* while to tear down (many seconds, for our bigger
+// problems). So instead of having one per solver, we keep the ones
+// we have made around and hand them out again. A context is only
+// used by one solver at a time. They never get freed; at exit there
+// is no point.
+class ContextPool {
+public:
+  z3::context *get() {
+    std::lock_guard<std::mutex> guard(lock_);
+    if (free_.empty()) return new z3::context;
+    z3::context *c = free_.back();
+    free_.pop_back();
+    return c;
+  }
+  void put(z3::context *c) {
+    std::lock_guard<std::mutex> guard(lock_);
+    free_.push_back(c);
+  }
+private:
+  std::mutex lock_;
+  std::vector<z3::context *> free_;
+};
+ContextPool &contextPool() {
+  static ContextPool *pool = new ContextPool;
+  return *pool;
+}
+
+// A context from the pool, which goes back when this does
+class PooledContext {
+public:
+  PooledContext() : c_(contextPool().get()) {}
+  ~PooledContext() { contextPool().put(c_); }
+  PooledContext(const PooledContext &) = delete;
+  void operator=(const PooledContext &) = delete;
+  z3::context &get() { return *c_; }
+private:
+  z3::context *c_;
+};
+
+class Z3Backend : public SmtSolverImpl {
+public:
+  explicit Z3Backend(SmtContext &c)
+    : c_(c), z3c_(pooled_.get()), s_(z3c_), exprs_(z3c_),
+      objective_(z3c_.int_val(0)) {}
+
+  void add(const SmtExpr &e) override {
+    guard([&] {
+      z3::expr z = translate(e.id());
+      s_.add(z);
+      hard_.push_back(z);
+    });
+  }
+  void push() override {
+    guard([&] { s_.push(); });
+    scopes_.push_back(hard_.size());
+  }
+  void pop() override {
+    guard([&] { s_.pop(); });
+    hard_.erase(hard_.begin() + scopes_.back(), hard_.end());
+    scopes_.pop_back();
+  }
+
+  void minimize(const SmtExpr &e) override {
+    guard([&] { objective_ = objective_ + translate(e.id()); });
+    haveObjective_ = true;
+  }
+
+  void add_soft(const SmtExpr &e, smt_uint weight) override {
+#if USE_Z3_OPTIMIZER
+    guard([&] {
+      // The core-guided MaxSAT engines work up from proven lower
+      // bounds, so they can stop as soon as they find a solution
+      // that meets one.
+      if (!haveSoft_) {
+        z3::params p(z3c_);
+        p.set("maxsat_engine", "maxres");
+        s_.set(p);
+      }
+      z3::expr z = translate(e.id());
+      softHandle_ = s_.add(z, (unsigned)weight).h();
+      soft_.push_back(std::make_pair(z, weight));
+      haveSoft_ = true;
+    });
+#else
+    // Without the optimizer, soft constraints just go into the sum
+    // that we minimize by hand. (Built on the Z3 side, since we might
+    // be on one of several threads sharing the context.)
+    guard([&] {
+      objective_ = objective_ + ite(translate(e.id()), z3c_.int_val(0),
+                                    z3c_.int_val((uint64_t)weight));
+    });
+    haveObjective_ = true;
+#endif
+  }
+
+  void set_timeout(unsigned ms) override { timeout_ = ms; }
+  void set_initial_value(const SmtExpr &var, bool value) override {
+    hints_.push_back(std::make_pair(var.id(), value));
+  }
+
+  SmtResult check() override {
+    return guard([&] {
+      Clock::time_point deadline = kNoDeadline;
+      if (timeout_) {
+        deadline = Clock::now() + std::chrono::milliseconds(timeout_);
+      }
+#if USE_Z3_OPTIMIZER
+      // We don't give the optimizer the hints. Asserting the cost of
+      // the hinted model as a bound only slows it down, and finding
+      // that model takes a good part of the time it needs to solve the
+      // whole thing.
+      if (haveObjective_ && !objectiveAdded_) {
+        objectiveHandle_ = s_.minimize(objective_).h();
+        objectiveAdded_ = true;
+      }
+      z3::check_result result = z3Check(s_, deadline, calls_);
+      if (result == z3::unsat) return SmtUnsat;
+      if (result == z3::sat) {
+        model_.reset(new z3::model(s_.get_model()));
+        lower_ = bound(true);
+        upper_ = bound(false);
+        return SmtSat;
+      }
+      // If it ran out of time, the optimizer still has the best model
+      // it found, if it found one. It might not have any bounds, or
+      // any model at all.
+      try {
+        model_.reset(new z3::model(s_.get_model()));
+      } catch (z3::exception &e) {
+        model_.reset();
+      }
+      if (!model_ || !isModel(*model_)) {
+        model_.reset();
+        return SmtUnknown;
+      }
+      upper_ = modelCost(*model_);
+      try {
+        lower_ = std::min(bound(true), upper_);
+      } catch (z3::exception &e) {
+        lower_ = 0;
+      }
+#else
+      z3::check_result result;
+      if (haveObjective_) {
+        result = handMinimize(s_, objective_, hintLits(), deadline, calls_,
+                              model_, lower_, upper_);
+      } else {
+        result = z3Check(s_, deadline, calls_);
+        if (result == z3::sat) model_.reset(new z3::model(s_.get_model()));
+      }
+      if (result != z3::sat) {
+        return result == z3::unsat ? SmtUnsat : SmtUnknown;
+      }
+#endif
+      return SmtSat;
+    });
+  }
+
+  SmtModel get_model() override {
+    assert(model_);
+    return guard([&] {
+      std::vector<int64_t> vals(c_.numVars(), 0);
+      for (unsigned var = 0; var < c_.numVars(); ++var) {
+        unsigned id = c_.varNode(var);
+        if (id >= index_.size() || index_[id] < 0) continue;
+        z3::expr val = model_->eval(exprs_[index_[id]], true);
+        if (c_.node(id).isBool) {
+          vals[var] = isTrue(val);
+        } else {
+          vals[var] = z3Int(z3c_, val);
+        }
+      }
+      return SmtModel(c_, std::move(vals));
+    });
+  }
+
+  smt_uint lower() override { return lower_; }
+  smt_uint upper() override { return upper_; }
+  unsigned solver_calls() override { return calls_; }
+
+  void print(std::ostream &os) override { os << s_; }
+
+private:
+  SmtContext &c_;
+  // This has to be the first of the Z3 things to be made, so that it
+  // is the last to go, after everything that uses the context.
+  PooledContext pooled_;
+  z3::context &z3c_;
+  Z3Solver s_;
+  // Translations of our expressions, by node id
+  z3::expr_vector exprs_;
+  std::vector<int> index_;
+  // What has been asserted, and how much of it at each push()
+  std::vector<z3::expr> hard_;
+  std::vector<size_t> scopes_;
+  std::vector<std::pair<z3::expr, smt_uint>> soft_;
+  std::vector<std::pair<unsigned, bool>> hints_;
+
+  z3::expr objective_;
+  bool haveObjective_{false};
+  bool objectiveAdded_{false};
+  unsigned objectiveHandle_{0};
+  bool haveSoft_{false};
+  unsigned softHandle_{0};
+  unsigned timeout_{0};
+
+  std::unique_ptr<z3::model> model_;
+  smt_uint lower_{0}, upper_{0};
+  unsigned calls_{0};
+
+  z3::expr translate(unsigned id);
+
+  bool isTrue(const z3::expr &e) {
+    return Z3_get_bool_value(z3c_, e) == Z3_L_TRUE;
+  }
+  bool isModel(z3::model &model) {
+    for (auto &e : hard_) {
+      if (!isTrue(model.eval(e, true))) return false;
+    }
+    return true;
+  }
+  // The initial values, for the variables that made it into the problem
+  z3::expr_vector hintLits() {
+    z3::expr_vector lits(z3c_);
+    for (auto &hint : hints_) {
+      if (hint.first >= index_.size() || index_[hint.first] < 0) continue;
+      z3::expr var = exprs_[index_[hint.first]];
+      lits.push_back(hint.second ? var : !var);
+    }
+    return lits;
+  }
+  smt_uint modelCost(z3::model &model) {
+    smt_uint cost = z3Int(z3c_, model.eval(objective_, true));
+    for (auto &soft : soft_) {
+      if (!isTrue(model.eval(soft.first, true))) cost += soft.second;
+    }
+    return cost;
+  }
+
+  smt_uint bound(bool isLower) {
+#if USE_Z3_OPTIMIZER
+    if (haveSoft_ || objectiveAdded_) {
+      z3::optimize::handle h(haveSoft_ ? softHandle_ : objectiveHandle_);
+      z3::expr b = isLower ? s_.lower(h) : s_.upper(h);
+      return (smt_uint)strtoull(b.get_decimal_string(0).c_str(),
+                                nullptr, 10);
+    }
+#endif
+    return 0;
+  }
+};
+
+z3::expr Z3Backend::translate(unsigned id) {
+  if (id < index_.size() && index_[id] >= 0) return exprs_[index_[id]];
+
+  const SmtNode &n = c_.node(id);
+  auto arg = [&] (int i) { return translate(n.args[i]); };
+  z3::expr e(z3c_);
+  switch (n.op) {
+  case SmtBoolVal: e = z3c_.bool_val(n.val != 0); break;
+  case SmtIntVal: e = z3c_.int_val((int64_t)n.val); break;
+  case SmtVar:
+    // Symbols made from numbers don't have to go through Z3's symbol
+    // table (which all the threads share).
+    e = z3c_.constant(c_.isFresh(n.val) ? z3c_.int_symbol(n.val) :
+                      z3c_.str_symbol(c_.varName(n.val).c_str()),
+                      n.isBool ? z3c_.bool_sort() : z3c_.int_sort());
+    break;
+  case SmtNot: e = !arg(0); break;
+  case SmtAnd: e = arg(0) && arg(1); break;
+  case SmtOr: e = arg(0) || arg(1); break;
+  case SmtEq: e = arg(0) == arg(1); break;
+  case SmtIte: e = ite(arg(0), arg(1), arg(2)); break;
+  case SmtAdd: e = arg(0) + arg(1); break;
+  case SmtMul: e = arg(0) * arg(1); break;
+  case SmtLe: e = arg(0) <= arg(1); break;
+  case SmtLt: e = arg(0) < arg(1); break;
+  }
+
+  if (index_.size() <= id) index_.resize(c_.numNodes(), -1);
+  index_[id] = exprs_.size();
+  exprs_.push_back(e);
+  return e;
+}
+
+}
+
+std::unique_ptr<SmtSolverImpl> makeZ3Solver(SmtContext &c) {
+  // XXX: Workaround a Z3 bug. When 'enable_sat' is set, we sometimes
+  // hit an exception (which should probably be an assertion) in
+  // inc_sat_solver. Setting opt.enable_set=false disables
+  // inc_sat_solver, which makes the problem go away.
+  // I should try to minimize this and file a bug.
+  // The parameters are global, so only set them once, in case
+  // solvers are being made on several threads.
+  static std::once_flag setParams;
+  std::call_once(setParams, [] { z3::set_param("opt.enable_sat", false); });
+  return std::unique_ptr<SmtSolverImpl>(new Z3Backend(c));
+}
+
+#endif
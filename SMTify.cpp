@@ -6,15 +6,21 @@
 #include "RMCInternal.h"
 
 #include <exception>
-
-#if USE_Z3
+#include <algorithm>
+#include <climits>
+#include <map>
+#include <thread>
 
 #include "PathCache.h"
 
 #include <llvm/IR/Function.h>
 #include <llvm/IR/CFG.h>
+#include <llvm/ADT/DenseSet.h>
+#include <llvm/ADT/PostOrderIterator.h>
 
 #include <llvm/IR/Dominators.h>
+#include <llvm/IR/DiagnosticInfo.h>
+#include <llvm/Support/CommandLine.h>
 
 #include "smt.h"
 
@@ -29,16 +35,48 @@ using namespace llvm;
 
 // Some tuning parameters
 
-// Should we pick the initial upper bound by seeing what the solver
-// produces without constraints instead of by binary searching up?
-const bool kGuessUpperBound = true;
-const int kFirstUpperBound = 16;
-// If we guess an upper bound, should we hope that it is optimal and
-// check the bound - 1 before we binary search?
-const bool kCheckFirstGuess = false;
 // Should we invert all bool variables; sort of useful for testing
 const bool kInvertBools = false;
 
+cl::opt<bool> UseMaxSAT(
+  "rmc-use-maxsat",
+  cl::desc("Give the optimizer the costs as weighted soft constraints"));
+// Always there, so that rmc-config can pass it whether or not we
+// have Z3; without Z3, the built-in one is all there is.
+cl::opt<bool> UseBuiltinSMT(
+  "rmc-builtin-smt",
+  cl::desc("Use the built-in pseudo-Boolean optimizer instead of Z3"));
+
+cl::opt<unsigned> SMTThreads(
+  "rmc-smt-threads",
+  cl::desc("Number of threads to solve independent parts of an SMT "
+           "problem with (0 means one per CPU, or just one when "
+           "-rmc-jobs is analyzing several functions at once)"),
+  cl::init(0));
+
+cl::opt<unsigned> SMTTimeout(
+  "rmc-smt-timeout",
+  cl::desc("Milliseconds to let the SMT solver spend on each function "
+           "before settling for the best cuts found so far (0 = no limit)"),
+  cl::init(0));
+
+// Every function being analyzed at once gets its own solver, each
+// with this many threads (and, with Z3, a context per thread), so
+// the two multiply. By default, only one of them uses all the CPUs.
+unsigned smtThreads(bool concurrent) {
+  unsigned threads = SMTThreads;
+  if (!threads && !concurrent) threads = std::thread::hardware_concurrency();
+  return threads ? threads : 1;
+}
+
+SmtBackend smtBackend() {
+#if USE_Z3
+  return UseBuiltinSMT ? SmtBackendBuiltin : SmtBackendZ3;
+#else
+  return SmtBackendBuiltin;
+#endif
+}
+
 // Costs for different sorts of things that we insert.
 // XXX: These numbers are just made up.
 // And will vary based on platform.
@@ -53,7 +91,14 @@ const bool kInvertBools = false;
 // hardcoded as false in the SMT system. We also do some direct checks
 // of these flags in various places as an optimization to avoid
 // generating big SMT formulas we know will be false.
-// We could do a lot more pruning.
+//
+// Beyond that, before encoding we prune variables that can never be
+// part of a cheapest solution: sync anywhere a push edge can't need
+// it, when lwsync is available and no more expensive (see
+// findSyncEdges), and ctrl on branches that don't exist when we can't
+// add one. Path variables whose definitions come out constant, or the
+// same as another path's, don't get variables of their own (see
+// definePathFunc).
 struct TuningParams {
   int syncCost{100}; // mandatory.
   int lwsyncCost{-1};
@@ -130,96 +175,13 @@ TuningParams archParams(RMCTarget target) {
 bool debugSpew = false;
 
 
-// Z3 utility functions
+// SMT utility functions
 SmtExpr boolToInt(SmtExpr const &flag, int cost = 1) {
   SmtContext &c = flag.ctx();
   return ite(flag, c.int_val(cost), c.int_val(0));
 }
 
 
-// Code for optimizing
-// FIXME: should we try to use some sort of bigint?
-typedef smt_uint Cost;
-
-bool isCostUnder(SmtSolver &s, SmtExpr &costVar, Cost cost) {
-  s.push();
-  s.add(costVar <= s.ctx().int_val(cost));
-  bool isSat = doCheck(s);
-  s.pop();
-
-  errs() << "Trying cost " << cost << ": " << isSat << "\n";
-  return isSat;
-}
-
-// Generic binary search over a monotonic predicate
-typedef std::function<bool (Cost)> CostPred;
-
-// Given a monotonic predicate, find the first value in [lo, hi]
-// for which it holds. It needs to hold for hi.
-Cost findFirstTrue(CostPred pred, Cost lo, Cost hi) {
-  if (lo >= hi) return hi;
-  Cost mid = lo + (hi - lo) / 2; // funny to avoid overflow
-
-  if (pred(mid)) {
-    return findFirstTrue(pred, lo, mid);
-  } else {
-    return findFirstTrue(pred, mid + 1, hi);
-  }
-}
-
-// Given a monotonic predicate pred that is not always false, find the
-// lowest value c for which pred(c) is true.
-Cost findFirstTrue(CostPred pred) {
-  Cost lo = 0, hi = kFirstUpperBound;
-
-  // Search upwards to find some value for which pred(c) holds.
-  while (!pred(hi)) {
-    lo = hi + 1;
-    hi *= 2;
-    assert(hi != 0); // fail if we overflow
-  }
-
-  return findFirstTrue(pred, lo, hi);
-}
-
-// Given a solver and an expression, find a solution that minimizes
-// the expression through repeated calls to the solver.
-void handMinimize(SmtSolver &s, SmtExpr &costVar) {
-  auto costPred = [&] (Cost cost) { return isCostUnder(s, costVar, cost); };
-  Cost minCost;
-  if (kGuessUpperBound) {
-    // This is in theory arbitrarily worse but might be better in
-    // practice. Although the cost is bounded by the number of things
-    // we could do, so...
-    doCheck(s);
-    Cost upperBound = extractInt(s.get_model().eval(costVar));
-    errs() << "Upper bound: " << upperBound << "\n";
-    // The solver seems to often "just happen" to find the optimal
-    // solution, so maybe do a quick check on upperBound-1
-    if (kCheckFirstGuess && upperBound > 0 && !costPred(--upperBound)) {
-      minCost = upperBound + 1;
-    } else if (upperBound == 0) {
-      minCost = upperBound;
-    } else {
-      minCost = findFirstTrue(costPred, 0, upperBound);
-    }
-  } else {
-    minCost = findFirstTrue(costPred);
-  }
-  s.add(costVar == s.ctx().int_val(minCost));
-}
-
-// Given a solver and an expression, find a solution that minimizes
-// the expression.
-void minimize(SmtSolver &s, SmtExpr &costVar) {
-#if USE_Z3_OPTIMIZER
-  s.minimize(costVar);
-#else
-  handMinimize(s, costVar);
-#endif
-}
-
-
 // DenseMap can use pairs of keys as keys, so we represent edges as a
 // pair of BasicBlock*s. We represent paths as PathIDs.
 
@@ -252,12 +214,14 @@ BlockEdgeKey makeBlockEdgeKey(BasicBlock *block,
 }
 
 std::string makeVarString(BasicBlock *key) {
-  return key ? key->getName().str() : "<outside>";
+  return key ? blockName(key) : "<outside>";
 }
 
 #if LONG_PATH_NAMES
 // This is an awful hack; we stick the PathCache into TLS so we can use
-// the whole expanded path as the key.
+// the whole expanded path as the key. Each function's formulas get
+// built on a single thread, so with several functions being analyzed
+// at once, each still sees its own.
 __thread PathCache *debugPathCache = nullptr;
 std::string makeVarString(PathKey &key) {
   return debugPathCache->formatPath(key);
@@ -282,6 +246,8 @@ template<typename Key> struct DeclMap {
   const SmtSort sort;
   const std::string name;
   const bool enabled;
+  // How many variables we have made (some entries in map aren't)
+  unsigned numVars{0};
 };
 
 template<typename Key>
@@ -302,12 +268,20 @@ SmtExpr getFunc(DeclMap<Key> &map, Key key, bool *alreadyThere = nullptr) {
     if (alreadyThere) *alreadyThere = false;
   }
 
-  std::string name = map.name + "(" + makeVarString(key) + ")";
-  SmtExpr e = c.constant(name.c_str(), map.sort);
+  // The names are only there for reading dumps of the problem, and
+  // putting them together (especially with LONG_PATH_NAMES) is slow.
+  SmtExpr e;
+  if (debugSpew) {
+    std::string name = map.name + "(" + makeVarString(key) + ")";
+    e = c.constant(name.c_str(), map.sort);
+  } else {
+    e = c.fresh_constant(map.name.c_str(), map.sort);
+  }
   // Can use inverted boolean variables to help test optimization.
   if (kInvertBools && map.sort.is_bool()) e = !e;
 
   map.map.insert(std::make_pair(key, e));
+  map.numVars++;
 
   return e;
 }
@@ -330,95 +304,289 @@ SmtExpr getPathFunc(DeclMap<PathKey> &map,
 
 // We precompute this so that the solver doesn't need to consider
 // these values while trying to optimize the problems.
-// We should maybe compute these with normal linear algebra instead of
-// giving it to the SMT solver, though.
+//
+// The capacity of a block is how often we expect it to run relative
+// to the others: it is the sum of the capacities of its incoming
+// edges, and each outgoing edge gets a share of it according to the
+// branch's profile weights, or a guessed probability if it has none.
+// Blocks that return feed back into the entry block. This is a linear
+// system, which we solve exactly with some sparse Gaussian elimination
+// over the rationals and then scale up to the smallest integer
+// solution.
 // N.B. that capacity gets invented out of nowhere in loops
-DenseMap<EdgeKey, int> computeCapacities(const LoopInfo &loops, Function &F) {
-  SmtContext c;
-  SmtSolver s(c);
+namespace {
+
+// A rational number. Everything is kept reduced and the denominator
+// positive. Instead of trapping on overflow we just note it, and the
+// caller gives up on the whole thing.
+struct Frac {
+  int64_t num, den;
+  Frac(int64_t n = 0, int64_t d = 1) : num(n), den(d) {}
+  bool isZero() const { return num == 0; }
+};
 
-  DeclMap<BasicBlock *> nodeCapM(c.int_sort(), "node_cap");
-  DeclMap<EdgeKey> edgeCapM(c.int_sort(), "edge_cap");
+int64_t gcd64(int64_t a, int64_t b) {
+  if (a < 0) a = -a;
+  if (b < 0) b = -b;
+  while (b) { int64_t t = a % b; a = b; b = t; }
+  return a;
+}
 
-  //// Build the equations.
-  SmtExpr incomingEntryCap = c.int_val(0);
-  for (auto & block : F) {
-    SmtExpr nodeCap = getFunc(nodeCapM, &block);
+struct FracArith {
+  bool overflowed{false};
 
-    // Compute the node's incoming capacity
-    SmtExpr incomingCap = c.int_val(0);
-    for (auto i = pred_begin(&block), e = pred_end(&block); i != e; ++i) {
-      incomingCap = incomingCap + getEdgeFunc(edgeCapM, *i, &block);
+  int64_t mul(int64_t a, int64_t b) {
+    int64_t r;
+    if (__builtin_mul_overflow(a, b, &r)) overflowed = true;
+    return r;
+  }
+  int64_t add(int64_t a, int64_t b) {
+    int64_t r;
+    if (__builtin_add_overflow(a, b, &r)) overflowed = true;
+    return r;
+  }
+  Frac make(int64_t n, int64_t d) {
+    if (overflowed || d == 0) { overflowed = true; return Frac(); }
+    if (d < 0) { n = -n; d = -d; }
+    int64_t g = gcd64(n, d);
+    return g > 1 ? Frac(n / g, d / g) : Frac(n, d);
+  }
+
+  Frac sum(Frac a, Frac b) {
+    int64_t g = gcd64(a.den, b.den);
+    return make(add(mul(a.num, b.den / g), mul(b.num, a.den / g)),
+                mul(a.den, b.den / g));
+  }
+  Frac neg(Frac a) { return Frac(-a.num, a.den); }
+  Frac prod(Frac a, Frac b) {
+    int64_t g1 = gcd64(a.num, b.den), g2 = gcd64(b.num, a.den);
+    if (g1 == 0) g1 = 1;
+    if (g2 == 0) g2 = 1;
+    return make(mul(a.num / g1, b.num / g2), mul(a.den / g2, b.den / g1));
+  }
+  Frac quot(Frac a, Frac b) { return prod(a, Frac(b.den, b.num)); }
+};
+
+// Profile weights can be huge, and we want to keep the arithmetic
+// small, so they get scaled down to be at most this.
+const int64_t kMaxBranchWeight = 64;
+
+// Get the relative chances of a block going to each of its
+// successors. If the branch has profile data (from PGO or
+// __builtin_expect), we use that; otherwise, if the block is a loop
+// exit block, we make the probability higher for exits that stay in
+// the loop.
+// TODO: handle loop nesting in a smarter way.
+void branchNumerators(const LoopInfo &loops, BasicBlock *block,
+                      SmallVectorImpl<int64_t> &numerators) {
+  TerminatorInst *term = block->getTerminator();
+  unsigned numSuccs = term->getNumSuccessors();
+
+  MDNode *prof = term->getMetadata(LLVMContext::MD_prof);
+  MDString *tag = prof && prof->getNumOperands() == numSuccs + 1 ?
+    dyn_cast<MDString>(prof->getOperand(0)) : nullptr;
+  if (tag && tag->getString() == "branch_weights") {
+    uint64_t maxWeight = 0;
+    SmallVector<uint64_t, 2> weights;
+    for (unsigned i = 1; i <= numSuccs; ++i) {
+#if LLVM_VERSION_MAJOR == 3 && LLVM_VERSION_MINOR == 5
+      auto *weight = dyn_cast<ConstantInt>(prof->getOperand(i));
+#else
+      auto *weight = mdconst::dyn_extract<ConstantInt>(prof->getOperand(i));
+#endif
+      if (!weight) break;
+      weights.push_back(weight->getZExtValue());
+      maxWeight = std::max(maxWeight, weights.back());
+    }
+    if (weights.size() == numSuccs && maxWeight > 0) {
+      // Nothing gets rounded down to zero; a fence on a path that
+      // the profile never saw still shouldn't be free.
+      for (uint64_t weight : weights) {
+        numerators.push_back(std::max<int64_t>(
+          1, (weight * kMaxBranchWeight + maxWeight / 2) / maxWeight));
+      }
+      return;
     }
-    if (&block != &F.getEntryBlock()) {
-      s.add(nodeCap == incomingCap.simplify());
+  }
+
+  auto *loop = loops[block];
+  for (unsigned i = 0; i < numSuccs; ++i) {
+    if (loop && !loop->isLoopExiting(block)) {
+      numerators.push_back(1);
+    } else {
+      numerators.push_back(loops[term->getSuccessor(i)] == loop ? 1 : 4);
     }
+  }
+}
 
-    // Setup equations for outgoing edges
-    auto numerator =
-      [&] (BasicBlock *target) {
-      // If the block is a loop exit block, we make the probability
-      // higher for exits that stay in the loop.
-      // TODO: handle loop nesting in a smarter way.
-      auto *loop = loops[&block];
-      if (loop && !loop->isLoopExiting(&block)) return 1;
-      return loops[target] == loop ? 1 : 4;
-    };
+// A sparse row of the system, by column
+typedef std::map<unsigned, Frac> SparseRow;
+
+// Solve the capacity equations, with the entry block's capacity
+// fixed at 1. Returns false if the arithmetic overflowed or the
+// system has no solution (which happens when there is a loop that
+// can't be left, since capacity flowing into it has nowhere to go).
+bool solveCapacities(const LoopInfo &loops, Function &F,
+                     DenseMap<BasicBlock *, Frac> &nodeCaps,
+                     DenseMap<EdgeKey, Frac> &edgeCaps) {
+  // Unreachable blocks get nothing, so just number the reachable
+  // ones. Doing it in RPO keeps the fill-in down, since almost all
+  // of a block's predecessors come before it.
+  std::vector<BasicBlock *> blocks;
+  DenseMap<BasicBlock *, unsigned> index;
+  ReversePostOrderTraversal<Function *> rpot(&F);
+  for (BasicBlock *block : rpot) {
+    index[block] = blocks.size();
+    blocks.push_back(block);
+  }
+
+  //// Build the equations.
+  // Row v says c(v) - sum(Pr(u, v) * c(u)) = 0, except for the
+  // entry, whose row says c(entry) = 1.
+  FracArith a;
+  unsigned n = blocks.size();
+  // Each block's share of its capacity that goes out each successor
+  std::vector<SmallVector<Frac, 2>> shares(n);
+  std::vector<SparseRow> rows(n);
+  std::vector<Frac> rhs(n);
+  rhs[0] = Frac(1);
+  for (unsigned v = 0; v < n; ++v) {
+    rows[v][v] = Frac(1);
+  }
+  for (unsigned u = 0; u < n; ++u) {
+    BasicBlock *block = blocks[u];
+    SmallVector<int64_t, 2> numerators;
+    branchNumerators(loops, block, numerators);
+    int64_t denominator = 0;
+    for (int64_t num : numerators) denominator += num;
+    for (unsigned k = 0; k < numerators.size(); ++k) {
+      Frac share = a.make(numerators[k], denominator);
+      shares[u].push_back(share);
+      unsigned v = index[block->getTerminator()->getSuccessor(k)];
+      if (v == 0) continue;
+      rows[v][u] = a.sum(rows[v][u], a.neg(share));
+    }
+  }
 
-    auto i = succ_begin(&block), e = succ_end(&block);
-    int childCount = e - i;
-    int denominator = 0;
-    for (; i != e; ++i) {
-      denominator += numerator(*i);
+  //// Eliminate, pivoting down the diagonal.
+  // Which rows below the diagonal have something in each column
+  std::vector<std::vector<unsigned>> users(n);
+  for (unsigned v = 0; v < n; ++v) {
+    for (auto &entry : rows[v]) {
+      if (entry.first < v) users[entry.first].push_back(v);
+    }
+  }
+  for (unsigned i = 0; i < n; ++i) {
+    SparseRow &pivotRow = rows[i];
+    auto pivot = pivotRow.find(i);
+    if (pivot == pivotRow.end() || pivot->second.isZero()) return false;
+    Frac pivotVal = pivot->second;
+
+    for (unsigned j : users[i]) {
+      SparseRow &row = rows[j];
+      auto it = row.find(i);
+      if (it == row.end()) continue;
+      Frac factor = a.quot(it->second, pivotVal);
+      row.erase(it);
+      rhs[j] = a.sum(rhs[j], a.neg(a.prod(factor, rhs[i])));
+      for (auto &entry : pivotRow) {
+        unsigned k = entry.first;
+        if (k <= i) continue;
+        Frac val = a.sum(row[k], a.neg(a.prod(factor, entry.second)));
+        if (val.isZero()) {
+          row.erase(k);
+        } else {
+          if (k < j) users[k].push_back(j);
+          row[k] = val;
+        }
+      }
+      if (a.overflowed) return false;
     }
-    i = succ_begin(&block), e = succ_end(&block);
-    for (; i != e; ++i) {
-      // For now, we assume even probabilities.
-      // Would be an improvement to do better
-      SmtExpr edgeCap = getEdgeFunc(edgeCapM, &block, *i);
-      // We want: c(v, u) == Pr(v, u) * c(v). Since Pr(v, u) ~= n(v,u)/d(v,u),
-      // we do
-      // d(v,u) * c(v, u) == c(v) * n(v,u)
-      s.add(edgeCap * c.int_val(denominator) ==
-            nodeCap * c.int_val(numerator(*i)));
+  }
+
+  //// Back substitute.
+  std::vector<Frac> x(n);
+  for (unsigned i = n; i-- > 0; ) {
+    Frac val = rhs[i];
+    for (auto &entry : rows[i]) {
+      if (entry.first > i) {
+        val = a.sum(val, a.neg(a.prod(entry.second, x[entry.first])));
+      }
+    }
+    x[i] = a.quot(val, rows[i][i]);
+    if (a.overflowed || x[i].num < 0) return false;
+  }
+
+  for (unsigned v = 0; v < n; ++v) {
+    BasicBlock *block = blocks[v];
+    nodeCaps[block] = x[v];
+    // If a block branches to the same place more than one way, the
+    // edge gets all of those shares.
+    for (unsigned k = 0; k < shares[v].size(); ++k) {
+      Frac &cap = edgeCaps[
+        std::make_pair(block, block->getTerminator()->getSuccessor(k))];
+      cap = a.sum(cap, a.prod(x[v], shares[v][k]));
     }
     // Populate the capacities for the fictional back edges to the
     // function entry point.
     // Blocks that don't have any succesors end in a return or the like.
-    if (childCount == 0) {
-      SmtExpr returnCap = getEdgeFunc(edgeCapM, &block, &F.getEntryBlock());
-      s.add(returnCap == nodeCap);
-      incomingEntryCap = incomingEntryCap + returnCap;
+    if (succ_begin(block) == succ_end(block)) {
+      edgeCaps[std::make_pair(block, &F.getEntryBlock())] = x[v];
     }
   }
+  return !a.overflowed;
+}
 
-  SmtExpr entryNodeCap = getFunc(nodeCapM, &F.getEntryBlock());
-  // Make the entry node equations add up.
-  s.add(entryNodeCap == incomingEntryCap);
-  // Keep all zeros from working:
-  s.add(entryNodeCap > c.int_val(0));
-
-  //// Extract a solution.
-  DenseMap<EdgeKey, int> caps;
+}
 
-  bool success = doCheck(s);
-  assert_(success);
-  SmtModel model = s.get_model();
-  for (auto & entry : edgeCapM.map) {
-    EdgeKey edge = entry.first;
-    int cap = extractInt(model.eval(entry.second));
-    caps.insert(std::make_pair(edge, cap));
-    //errs() << "Edge cap: " << makeVarString(edge) << ": " << cap << "\n";
-  }
-  // Cram the node weights in with <block, nullptr> keys
-  for (auto & entry : nodeCapM.map) {
-    EdgeKey edge = std::make_pair(entry.first, nullptr);
-    int cap = extractInt(model.eval(entry.second));
-    caps.insert(std::make_pair(edge, cap));
+EdgeCapacities llvm::computeCapacities(const LoopInfo &loops, Function &F) {
+  EdgeCapacities caps;
+
+  DenseMap<BasicBlock *, Frac> nodeCaps;
+  DenseMap<EdgeKey, Frac> edgeCaps;
+  if (solveCapacities(loops, F, nodeCaps, edgeCaps)) {
+    // Scale everything up by the lcm of the denominators, and back
+    // down by the gcd of the numerators, to get the smallest integer
+    // solution.
+    FracArith a;
+    int64_t scale = 1, common = 0;
+    auto note = [&] (Frac f) {
+      scale = a.mul(scale / gcd64(scale, f.den), f.den);
+    };
+    for (auto & entry : nodeCaps) note(entry.second);
+    for (auto & entry : edgeCaps) note(entry.second);
+    auto scaled = [&] (Frac f) { return a.mul(f.num, scale / f.den); };
+    for (auto & entry : nodeCaps) common = gcd64(common, scaled(entry.second));
+    for (auto & entry : edgeCaps) common = gcd64(common, scaled(entry.second));
+
+    if (!a.overflowed && common > 0 && scale / common <= INT_MAX) {
+      for (auto & entry : edgeCaps) {
+        caps.insert(std::make_pair(entry.first,
+                                   (int)(scaled(entry.second) / common)));
+      }
+      // Cram the node weights in with <block, nullptr> keys
+      for (auto & entry : nodeCaps) {
+        caps.insert(std::make_pair(std::make_pair(entry.first, nullptr),
+                                   (int)(scaled(entry.second) / common)));
+      }
+      return caps;
+    }
   }
 
-  //errs() << "Entry cap: " << extractInt(model.eval(entryNodeCap)) << "\n";
-
+  // If that didn't work out (the numbers got too big, or there was a
+  // loop that never exits), just weigh edges by how deeply nested in
+  // loops they are.
+  for (auto & block : F) {
+    int cap = 1 << (2 * std::min(loops.getLoopDepth(&block), 8u));
+    for (auto i = succ_begin(&block), e = succ_end(&block); i != e; ++i) {
+      caps.insert(std::make_pair(std::make_pair(&block, *i), cap));
+    }
+    if (succ_begin(&block) == succ_end(&block)) {
+      caps.insert(std::make_pair(
+                    std::make_pair(&block, &F.getEntryBlock()), cap));
+    }
+    caps.insert(std::make_pair(std::make_pair(&block, nullptr), cap));
+  }
   return caps;
 }
 
@@ -428,6 +596,7 @@ struct VarMaps {
   PathCache &pc;
   DenseMap<BasicBlock *, Action *> &bb2action;
   DominatorTree &domTree;
+  std::vector<std::pair<BasicBlock *, std::string>> &remarks;
   TuningParams params;
 
   DeclMap<EdgeKey> sync;
@@ -462,12 +631,57 @@ struct VarMaps {
   // necessarily two blocks connected in the CFG
   DeclMap<std::pair<BlockKey, EdgePathKey>> usesData;
   DeclMap<std::pair<BlockKey, std::pair<PathID, BlockPathKey>>> pathData;
+
+  // Whether an uncut path can reach a block, for the path-free
+  // encodings. Keyed by the query and then the block.
+  DeclMap<std::pair<BlockEdgeKey, BlockKey>> reachP;
+  DeclMap<std::pair<BlockEdgeKey, BlockKey>> reachV;
+  DeclMap<std::pair<BlockEdgeKey, BlockKey>> reachCtrl;
+  DeclMap<std::pair<BlockEdgeKey, BlockKey>> reachX;
+
+  // If set, sync only gets considered on the CFG edges in syncEdges.
+  bool pruneSync;
+  DenseSet<EdgeKey> syncEdges;
+  // Path variables, by the id of the formula that defines them
+  DenseMap<unsigned, SmtExpr> pathDefs;
 };
 
+template<typename Key>
+void noteVars(RMCStats &stats, const DeclMap<Key> &map) {
+  if (map.numVars) stats.smtVars.push_back(std::make_pair(map.name,
+                                                          map.numVars));
+}
+void noteAllVars(RMCStats &stats, const VarMaps &m) {
+  noteVars(stats, m.sync);
+  noteVars(stats, m.lwsync);
+  noteVars(stats, m.dmbst);
+  noteVars(stats, m.dmbld);
+  noteVars(stats, m.pathDmbld);
+  noteVars(stats, m.release);
+  noteVars(stats, m.acquire);
+  noteVars(stats, m.pcut);
+  noteVars(stats, m.vcut);
+  noteVars(stats, m.xcut);
+  noteVars(stats, m.pathPcut);
+  noteVars(stats, m.pathVcut);
+  noteVars(stats, m.pathXcut);
+  noteVars(stats, m.isync);
+  noteVars(stats, m.pathIsync);
+  noteVars(stats, m.pathCtrlIsync);
+  noteVars(stats, m.usesCtrl);
+  noteVars(stats, m.pathCtrl);
+  noteVars(stats, m.allPathsCtrl);
+  noteVars(stats, m.usesData);
+  noteVars(stats, m.pathData);
+  noteVars(stats, m.reachP);
+  noteVars(stats, m.reachV);
+  noteVars(stats, m.reachCtrl);
+  noteVars(stats, m.reachX);
+}
+
 // Generalized it.
 typedef std::function<SmtExpr (PathID path)> PathFunc;
 
-typedef std::function<SmtExpr (PathID path, bool *already)> GetPathVarFunc;
 typedef std::function<SmtExpr (BasicBlock *src, BasicBlock *dst, PathID path)>
   EdgeFunc;
 
@@ -477,47 +691,119 @@ SmtExpr forAllPaths(SmtSolver &s, VarMaps &m,
   // Now try all the paths
   SmtExpr allPaths = s.ctx().bool_val(true);
 
-  PathCache::SkipSet skip;
-  if (skipBlock) skip.insert(skipBlock);
-  PathList paths = m.pc.findAllSimplePaths(&skip, src, dst);
-  for (auto & path : paths) {
+  const PathCache::PathQuery &query =
+    m.pc.findAllSimplePathsCached(skipBlock, src, dst);
+  // No paths would mean everything is cut, so callers need to check
+  // the budget first and do something else.
+  assert(!query.overBudget && "path query went over budget");
+  for (auto & path : query.paths) {
     allPaths = allPaths && func(path);
   }
   return allPaths.simplify();
 }
 
+// For cuts that are purely a property of individual CFG edges, we
+// don't need to look at the paths one at a time. Instead we introduce
+// a variable for each block in the region between src and dst
+// that must be true if some uncut path reaches it, and then require
+// that dst not be reached. This is linear in the size of the CFG
+// instead of in the number of paths.
+//
+// The reach variables are only constrained in one direction, so this
+// is only right because everything we build only ever needs cuts to
+// be present, never absent.
+typedef DeclMap<std::pair<BlockEdgeKey, BlockKey>> ReachMap;
+typedef std::function<SmtExpr (BasicBlock *src, BasicBlock *dst)>
+  EdgeCutFunc;
+
+SmtExpr forAllPathsCut(SmtSolver &s, VarMaps &m, ReachMap &reachMap,
+                       BasicBlock *src, BasicBlock *dst, EdgeCutFunc func,
+                       BasicBlock *skipBlock = nullptr) {
+  const PathCache::PathRegion &region =
+    m.pc.findPathRegionCached(skipBlock, src, dst);
+  if (region.empty()) return s.ctx().bool_val(true);
+
+  BlockEdgeKey query = makeBlockEdgeKey(skipBlock, src, dst);
+  auto reach = [&] (BasicBlock *block) {
+    return getFunc(reachMap, std::make_pair(query, makeBlockKey(block)));
+  };
+
+  for (auto & edge : region.edges) {
+    BasicBlock *from = edge.first, *to = edge.second;
+    SmtExpr uncut = !func(from, to);
+    SmtExpr reached = from == src ? uncut : reach(from) && uncut;
+    s.add(implies(reached.simplify(), reach(to)));
+  }
+
+  return !reach(dst);
+}
+
+// Most path variables would just be stand-ins for something we
+// already have: false, very often, when nothing along the path can be
+// used at all, or a single edge's variable, or exactly what some
+// other path came out as. Only give a path a variable when its
+// definition isn't one of those.
+template<typename Key>
+SmtExpr definePathFunc(SmtSolver &s, VarMaps &m, DeclMap<Key> &map, Key key,
+                       SmtExpr def) {
+  def = def.simplify();
+  SmtExpr isCut = def;
+  SmtOp op = def.node().op;
+  if (op != SmtBoolVal && op != SmtVar && op != SmtNot) {
+    auto entry = m.pathDefs.find(def.id());
+    if (entry != m.pathDefs.end()) {
+      isCut = entry->second;
+    } else {
+      isCut = getFunc(map, key);
+      s.add(isCut == def);
+      m.pathDefs.insert(std::make_pair(def.id(), isCut));
+      return isCut;
+    }
+  }
+  map.map.insert(std::make_pair(key, isCut));
+  return isCut;
+}
+
 // I built a *lot* of infrastructure around the idea that we would
 // share the suffixes of paths to reduce the size of the problem. It
 // turns out, though, that certain things are a lot simpler if we
 // *don't* share path suffixes, and it isn't clear it helps much
 // anyways...
+//
+// pathKey maps a PathID to the key for it in map.
 #if NO_PATH_SUFFIX_SHARING
+template<typename Key, typename KeyFunc>
 SmtExpr forAllPathEdges(SmtSolver &s, VarMaps &m,
                         PathID path,
-                        GetPathVarFunc getVar,
+                        DeclMap<Key> &map, KeyFunc pathKey,
                         EdgeFunc func) {
   SmtContext &c = s.ctx();
 
-  bool alreadyMade;
-  SmtExpr isCut = getVar(path, &alreadyMade);
-  if (alreadyMade) return isCut;
+  Key key = pathKey(path);
+  auto entry = map.map.find(key);
+  if (entry != map.map.end()) return entry->second;
 
+  // Build the disjunction from the back, so that paths with the same
+  // suffix share the formula for it.
+  SmallVector<SmtExpr, 8> cuts;
   PathID rest;
-  SmtExpr somethingCut = c.bool_val(false);
   while (!m.pc.isEmpty(path) && !m.pc.isEmpty(rest = m.pc.getTail(path))) {
     BasicBlock *src = m.pc.getHead(path), *dst = m.pc.getHead(rest);
-    somethingCut = somethingCut || func(src, dst, path);
+    cuts.push_back(func(src, dst, path));
     path = rest;
   }
+  SmtExpr somethingCut = c.bool_val(false);
+  for (auto i = cuts.rbegin(), e = cuts.rend(); i != e; ++i) {
+    somethingCut = *i || somethingCut;
+  }
 
-  s.add(isCut == somethingCut.simplify());
-
-  return isCut;
+  return definePathFunc(s, m, map, key, somethingCut);
 }
 #else
+template<typename Key, typename KeyFunc>
 SmtExpr forAllPathEdges(SmtSolver &s, VarMaps &m,
                         PathID path,
-                        GetPathVarFunc getVar,
+                        DeclMap<Key> &map, KeyFunc pathKey,
                         EdgeFunc func) {
   SmtContext &c = s.ctx();
 
@@ -526,16 +812,15 @@ SmtExpr forAllPathEdges(SmtSolver &s, VarMaps &m,
     return c.bool_val(false);
   }
 
-  bool alreadyMade;
-  SmtExpr isCut = getVar(path, &alreadyMade);
-  if (alreadyMade) return isCut;
+  Key key = pathKey(path);
+  auto entry = map.map.find(key);
+  if (entry != map.map.end()) return entry->second;
 
   BasicBlock *src = m.pc.getHead(path), *dst = m.pc.getHead(rest);
   SmtExpr somethingCut = func(src, dst, path) ||
-    forAllPathEdges(s, m, rest, getVar, func);
-  s.add(isCut == somethingCut);
+    forAllPathEdges(s, m, rest, map, pathKey, func);
 
-  return isCut;
+  return definePathFunc(s, m, map, key, somethingCut);
 }
 #endif
 
@@ -554,7 +839,13 @@ SmtExpr makeCtrl(SmtSolver &s, VarMaps &m,
   //
   // If the outgoing dep isn't an instruction, then it's a parameter
   // and so we treat it like it dominates.
-  Instruction *load = dyn_cast<Instruction>(m.bb2action[dep]->outgoingDep);
+  Value *outgoingDep = m.bb2action[dep]->outgoingDep;
+  // If we can't add a ctrl dependency, we can only use the ones that
+  // are already there.
+  if (!paramEnabled(m.params.addCtrlCost) && !branchesOn(src, outgoingDep)) {
+    return s.ctx().bool_val(false);
+  }
+  Instruction *load = dyn_cast<Instruction>(outgoingDep);
   if (src == dep || !load || m.domTree.dominates(load, src)) {
     return getFunc(m.usesCtrl, makeBlockEdgeKey(dep, src, dst));
   } else {
@@ -566,7 +857,7 @@ SmtExpr makePathIsync(SmtSolver &s, VarMaps &m,
                       PathID path) {
   return forAllPathEdges(
     s, m, path,
-    [&] (PathID path, bool *b) { return getPathFunc(m.pathIsync, path, b); },
+    m.pathIsync, [&] (PathID path) { return makePathKey(path); },
     [&] (BasicBlock *src, BasicBlock *dst, PathID path) {
       return getEdgeFunc(m.isync, src, dst);
     });
@@ -584,8 +875,8 @@ SmtExpr makePathCtrlIsync(SmtSolver &s, VarMaps &m,
 
   return forAllPathEdges(
     s, m, path,
-    [&] (PathID path, bool *b) {
-      return getFunc(m.pathCtrlIsync, makeBlockPathKey(dep, path), b); },
+    m.pathCtrlIsync,
+    [&] (PathID path) { return makeBlockPathKey(dep, path); },
     [&] (BasicBlock *src, BasicBlock *dst, PathID path) {
       return makeCtrl(s, m, dep, src, dst) && makePathIsync(s, m, path);
     });
@@ -603,8 +894,7 @@ SmtExpr makePathCtrl(SmtSolver &s, VarMaps &m, PathID path) {
 
   return forAllPathEdges(
     s, m, path,
-    [&] (PathID path, bool *b) {
-      return getFunc(m.pathCtrl, makeBlockPathKey(dep, path), b); },
+    m.pathCtrl, [&] (PathID path) { return makeBlockPathKey(dep, path); },
     [&] (BasicBlock *src, BasicBlock *dst, PathID path) {
       return makeCtrl(s, m, dep, src, dst);
     });
@@ -613,9 +903,13 @@ SmtExpr makePathCtrl(SmtSolver &s, VarMaps &m, PathID path) {
 SmtExpr makeAllPathsCtrl(SmtSolver &s, VarMaps &m,
                          BasicBlock *src, BasicBlock *dst) {
   SmtExpr isCtrl = getEdgeFunc(m.allPathsCtrl, src, dst);
-  SmtExpr allPaths = forAllPaths(
-    s, m, src, dst,
-    [&] (PathID path) { return makePathCtrl(s, m, path); });
+  // Can't have a control dependency when it's not a load.
+  bool isLoad = m.bb2action[src] && m.bb2action[src]->outgoingDep;
+  SmtExpr allPaths = forAllPathsCut(
+    s, m, m.reachCtrl, src, dst,
+    [&] (BasicBlock *from, BasicBlock *to) {
+      return isLoad ? makeCtrl(s, m, src, from, to) : s.ctx().bool_val(false);
+    });
   s.add(isCtrl == allPaths);
   return isCtrl;
 }
@@ -671,12 +965,11 @@ SmtExpr makePathDataCut(SmtSolver &s, VarMaps &m,
     s, m, fullPath,
     // We need to include both the fullPath and the postfix because
     // we don't want to share postfixes incorrectly.
-    [&] (PathID path, bool *b) {
-      return getFunc(m.pathData,
-                     std::make_pair(
-                       makeBlockKey(bindSite),
-                       std::make_pair(fullPath, makeBlockPathKey(dep, path))),
-                       b);
+    m.pathData,
+    [&] (PathID path) {
+      return std::make_pair(
+        makeBlockKey(bindSite),
+        std::make_pair(fullPath, makeBlockPathKey(dep, path)));
     },
     [&] (BasicBlock *src, BasicBlock *dst, PathID path) {
       SmtExpr cut = makeData(s, m, dep, dst, fullPath, bindSite);
@@ -696,8 +989,10 @@ SmtExpr makeEdgeVcut(SmtSolver &s, VarMaps &m,
   if (isPush) {
     return getEdgeFunc(m.sync, src, dst);
   } else {
-    SmtExpr cut = getEdgeFunc(m.lwsync, src, dst) ||
-      getEdgeFunc(m.sync, src, dst);
+    SmtExpr cut = getEdgeFunc(m.lwsync, src, dst);
+    if (!m.pruneSync || m.syncEdges.count(makeEdgeKey(src, dst))) {
+      cut = cut || getEdgeFunc(m.sync, src, dst);
+    }
     if (dmbst) cut = cut || getEdgeFunc(m.dmbst, src, dst);
     return cut;
   }
@@ -725,9 +1020,8 @@ SmtExpr makePathVcut(SmtSolver &s, VarMaps &m,
 
   return forAllPathEdges(
     s, m, path,
-    [&] (PathID path, bool *b) {
-      return getFunc(isPush ? m.pathPcut : m.pathVcut,
-                     makeBlockPathKey(nullptr, path), b); },
+    isPush ? m.pathPcut : m.pathVcut,
+    [&] (PathID path) { return makeBlockPathKey(nullptr, path); },
     [&] (BasicBlock *src, BasicBlock *dst, PathID path) {
       return makeEdgeVcut(s, m, src, dst, isPush, dmbst);
     });
@@ -744,8 +1038,7 @@ SmtExpr makePathDmbldCut(SmtSolver &s, VarMaps &m,
   if (!m.dmbld.enabled) return s.ctx().bool_val(false);
   return forAllPathEdges(
     s, m, path,
-    [&] (PathID path, bool *b) {
-      return getPathFunc(m.pathDmbld, path, b); },
+    m.pathDmbld, [&] (PathID path) { return makePathKey(path); },
     [&] (BasicBlock *src, BasicBlock *dst, PathID path) {
       return getEdgeFunc(m.dmbld, src, dst);
     });
@@ -840,6 +1133,44 @@ SmtExpr makeRelAcqCut(SmtSolver &s, VarMaps &m, Action &src, Action &dst,
   return relAcq.simplify();
 }
 
+// When there are too many paths from src to dst to look at them one
+// at a time, we fall back to a conservative version of makePathXcut
+// that works on the region between them: a path is cut if some edge
+// on it has a fence, or, if dst is simple writes, a ctrl dependency
+// (subject to the same side condition as in makePathXcut, which
+// doesn't depend on the path). Ctrl+isync and data cuts aren't
+// properties of single edges, so we don't try to use them.
+SmtExpr makeRegionXcut(SmtSolver &s, VarMaps &m, Action &src, Action &dst,
+                       BasicBlock *bindSite) {
+  SmtContext &c = s.ctx();
+  bool useCtrl = m.usesCtrl.enabled && src.outgoingDep &&
+    dst.type == ActionSimpleWrites;
+  bool dmbst = m.dmbst.enabled && src.type == ActionSimpleWrites;
+
+  SmtExpr ctrlOk = c.bool_val(true);
+  if (useCtrl && src.bb != dst.bb) {
+    ctrlOk = makeAllPathsCtrl(s, m, src.bb, src.bb) ||
+      makeXcut(s, m, src, src, bindSite);
+  }
+
+  return forAllPathsCut(
+    s, m, m.reachX, src.bb, dst.bb,
+    [&] (BasicBlock *from, BasicBlock *to) {
+      SmtExpr cut = makeEdgeVcut(s, m, from, to, false, dmbst);
+      if (m.dmbld.enabled) cut = cut || getEdgeFunc(m.dmbld, from, to);
+      if (useCtrl) cut = cut || (makeCtrl(s, m, src.bb, from, to) && ctrlOk);
+      return cut;
+    },
+    bindSite);
+}
+
+void reportOverBudget(VarMaps &m, Action &src, Action &dst) {
+  m.remarks.push_back(std::make_pair(
+    src.bb,
+    "too many paths from " + src.debugName() + " to " + dst.debugName() +
+    "; using a conservative analysis for the execution edge"));
+}
+
 SmtExpr makeXcut(SmtSolver &s, VarMaps &m, Action &src, Action &dst,
                  BasicBlock *bindSite) {
   bool alreadyMade;
@@ -847,10 +1178,16 @@ SmtExpr makeXcut(SmtSolver &s, VarMaps &m, Action &src, Action &dst,
                           &alreadyMade);
   if (alreadyMade) return isCut;
 
-  SmtExpr allPathsCut = forAllPaths(
-    s, m, src.bb, dst.bb,
-    [&] (PathID path) { return makePathXcut(s, m, path, dst, bindSite); },
-    bindSite);
+  SmtExpr allPathsCut = s.ctx().bool_val(false);
+  if (m.pc.exceedsPathBudget(bindSite, src.bb, dst.bb)) {
+    reportOverBudget(m, src, dst);
+    allPathsCut = makeRegionXcut(s, m, src, dst, bindSite);
+  } else {
+    allPathsCut = forAllPaths(
+      s, m, src.bb, dst.bb,
+      [&] (PathID path) { return makePathXcut(s, m, path, dst, bindSite); },
+      bindSite);
+  }
   SmtExpr relAcqCut = makeRelAcqCut(s, m, src, dst, ExecutionEdge);
   s.add(isCut == (allPathsCut || relAcqCut));
 
@@ -864,9 +1201,16 @@ SmtExpr makeVcut(SmtSolver &s, VarMaps &m, Action &src, Action &dst,
   SmtExpr isCut = getFunc(isPush ? m.pcut : m.vcut,
                           makeBlockEdgeKey(bindSite, src.outBlock, dst.bb));
 
-  SmtExpr allPathsCut = forAllPaths(
-    s, m, src.outBlock, dst.bb,
-    [&] (PathID path) { return makePathVcut(s, m, path, isPush); },
+  // If the source is simple writes, we can use a dmb st for
+  // visibility. dmb st only orders writes, but visibility edges
+  // only meaningfully affect writes.
+  bool dmbst = m.dmbst.enabled && src.outBlock == src.bb &&
+    src.type == ActionSimpleWrites;
+  SmtExpr allPathsCut = forAllPathsCut(
+    s, m, isPush ? m.reachP : m.reachV, src.outBlock, dst.bb,
+    [&] (BasicBlock *from, BasicBlock *to) {
+      return makeEdgeVcut(s, m, from, to, isPush, dmbst);
+    },
     bindSite);
   SmtExpr relAcqCut = makeRelAcqCut(s, m, src, dst, edgeType);
   s.add(isCut == (allPathsCut || relAcqCut));
@@ -884,17 +1228,32 @@ void processMap(DeclMap<T> &map, SmtModel &model,
   }
 }
 
-std::vector<EdgeCut> RealizeRMC::smtAnalyzeInner() {
-  // XXX: Workaround a Z3 bug. When 'enable_sat' is set, we sometimes
-  // hit an exception (which should probably be an assertion) in
-  // inc_sat_solver. Setting opt.enable_set=false disables
-  // inc_sat_solver, which makes the problem go away.
-  // I should try to minimize this and file a bug.
-  z3::set_param("opt.enable_sat", false);
+// Everywhere but on push edges, an lwsync does anything a sync would,
+// so if lwsync is no more expensive, there is no point considering
+// sync anywhere a push edge can't need it.
+void findSyncEdges(VarMaps &m, std::vector<RMCEdge> &edges) {
+  m.pruneSync = paramEnabled(m.params.lwsyncCost) &&
+    m.params.lwsyncCost <= m.params.syncCost;
+  if (!m.pruneSync) return;
+
+  for (auto & edge : edges) {
+    if (edge.edgeType != PushEdge) continue;
+    const PathCache::PathRegion &region =
+      m.pc.findPathRegionCached(edge.bindSite, edge.src->outBlock,
+                               edge.dst->bb);
+    for (auto & cfgEdge : region.edges) {
+      m.syncEdges.insert(cfgEdge);
+    }
+  }
+}
 
+bool RealizeRMC::smtAnalyzeInner(std::vector<EdgeCut> &cuts, bool &optimal) {
   TuningParams params = archParams(target_);
   SmtContext c;
-  SmtSolver s(c);
+  // Problems often fall apart into independent pieces, which are
+  // much easier to solve separately.
+  SmtSolver s(c, smtBackend(), smtThreads(concurrent_));
+  PhaseTimer encodeTimer(stats_.encodeTime);
 
 #if LONG_PATH_NAMES
   debugPathCache = &pc_; /* :( */
@@ -903,7 +1262,8 @@ std::vector<EdgeCut> RealizeRMC::smtAnalyzeInner() {
   VarMaps m = {
     pc_,
     bb2action_,
-    domTree_,
+    *domTree_,
+    remarks_,
     params,
     DeclMap<EdgeKey>(c.bool_sort(), "sync"),
     DeclMap<EdgeKey>(c.bool_sort(), "lwsync",
@@ -931,7 +1291,8 @@ std::vector<EdgeCut> RealizeRMC::smtAnalyzeInner() {
     DeclMap<BlockPathKey>(c.bool_sort(), "path_ctrl_isync"),
 
     DeclMap<BlockEdgeKey>(c.bool_sort(), "uses_ctrl",
-                          paramEnabled(params.addCtrlCost)),
+                          paramEnabled(params.addCtrlCost) ||
+                          paramEnabled(params.useCtrlCost)),
     DeclMap<BlockPathKey>(c.bool_sort(), "path_ctrl"),
     DeclMap<EdgeKey>(c.bool_sort(), "all_paths_ctrl"),
 
@@ -940,10 +1301,19 @@ std::vector<EdgeCut> RealizeRMC::smtAnalyzeInner() {
       paramEnabled(params.useDataCost)),
     DeclMap<std::pair<BlockKey, std::pair<PathID, BlockPathKey>>>(
       c.bool_sort(), "path_data"),
+
+    DeclMap<std::pair<BlockEdgeKey, BlockKey>>(c.bool_sort(), "reach_p"),
+    DeclMap<std::pair<BlockEdgeKey, BlockKey>>(c.bool_sort(), "reach_v"),
+    DeclMap<std::pair<BlockEdgeKey, BlockKey>>(c.bool_sort(), "reach_ctrl"),
+    DeclMap<std::pair<BlockEdgeKey, BlockKey>>(c.bool_sort(), "reach_x"),
+
+    false, DenseSet<EdgeKey>(),
+    DenseMap<unsigned, SmtExpr>(),
   };
+  findSyncEdges(m, edges_);
 
   // Compute the capacity function
-  DenseMap<EdgeKey, int> edgeCap = computeCapacities(loopInfo_, func_);
+  EdgeCapacities edgeCap = getEdgeCaps();
   auto weight =
     [&] (BasicBlock *src, BasicBlock *dst) {
     // The weight of an edge is based on its graph capacity and its loop depth.
@@ -986,8 +1356,14 @@ std::vector<EdgeCut> RealizeRMC::smtAnalyzeInner() {
   //////////
   // OK, now build a cost function. This will probably take a lot of
   // tuning.
-  SmtExpr costVar = c.int_const("cost");
   SmtExpr cost = c.int_val(0);
+  // Instead of handing the optimizer one big sum to minimize, we can
+  // give it each cost as a weighted soft constraint, which a MaxSAT
+  // engine can work with more directly.
+  auto addCost = [&] (SmtExpr v, int weight) {
+    cost = cost + boolToInt(v, weight);
+    if (UseMaxSAT && weight > 0) s.add_soft(!v, weight);
+  };
 
   BasicBlock *src, *dst;
   SmtExpr v = c.bool_val(false);
@@ -996,8 +1372,7 @@ std::vector<EdgeCut> RealizeRMC::smtAnalyzeInner() {
   for (auto & cuttype : cuttypes) {
     for (auto & entry : cuttype.map.map) {
       unpack(unpack(src, dst), v) = fix_pair(entry);
-      cost = cost +
-        boolToInt(v, cuttype.cost*weight(src, dst)+1);
+      addCost(v, cuttype.cost*weight(src, dst)+1);
     }
   }
   // Ctrl cost
@@ -1007,8 +1382,7 @@ std::vector<EdgeCut> RealizeRMC::smtAnalyzeInner() {
     auto ctrlWeight =
       branchesOn(src, bb2action_[dep]->outgoingDep) ?
         params.useCtrlCost : params.addCtrlCost;
-    cost = cost +
-      boolToInt(v, ctrlWeight*weight(src, dst));
+    addCost(v, ctrlWeight*weight(src, dst));
   }
   // Data dep cost
   for (auto & entry : m.usesData.map) {
@@ -1019,28 +1393,88 @@ std::vector<EdgeCut> RealizeRMC::smtAnalyzeInner() {
     // XXX: this is a hack that depends on us only using actions in
     // usesData things
     BasicBlock *pred = bb2action_[dst]->bb->getSinglePredecessor();
-    cost = cost +
-      boolToInt(v, params.useDataCost*weight(pred, dst));
+    addCost(v, params.useDataCost*weight(pred, dst));
   }
 
-  s.add(costVar == cost.simplify());
+  //////////
+  // Start the solver off from the fences the greedy algorithm would
+  // use (and nothing else). That is usually not too far from optimal,
+  // and it saves the solver a lot of looking for a bound on the cost.
+  DenseMap<BasicBlock *, BlockCut> fences = greedyFences();
+  // Critical edges have been split, so a fence on src->dst is either
+  // at the back of src or at the front of dst.
+  auto fenceOn = [&] (BasicBlock *src, BasicBlock *dst) {
+    auto back = fences.find(src);
+    if (back != fences.end() && !back->second.isFront) {
+      return back->second.type;
+    }
+    auto front = fences.find(dst);
+    if (front != fences.end() && front->second.isFront) {
+      return front->second.type;
+    }
+    return CutNone;
+  };
+  for (auto & cuttype : cuttypes) {
+    for (auto & entry : cuttype.map.map) {
+      unpack(unpack(src, dst), v) = fix_pair(entry);
+      CutType type = fenceOn(src, dst);
+      if (type == CutLwsync && !m.lwsync.enabled) type = CutSync;
+      s.set_initial_value(v, type == cuttype.type);
+    }
+  }
+  for (auto & entry : m.usesCtrl.map) {
+    s.set_initial_value(entry.second, false);
+  }
+  for (auto & entry : m.usesData.map) {
+    s.set_initial_value(entry.second, false);
+  }
 
   //////////
   // Print out the model for debugging
   if (debugSpew) dumpSolver(s);
 
   // Optimize the cost.
-  minimize(s, costVar);
+  // (We hand over the sum itself rather than a variable equal to it
+  // so that it can be split up along with everything else.)
+  if (!UseMaxSAT) s.minimize(cost);
+
+  stats_.solved = true;
+  noteAllVars(stats_, m);
+  stats_.smtNodes = c.numNodes();
+  stats_.smtAssertions = s.num_assertions();
+  encodeTimer.stop();
 
   // OK, go solve it.
-  doCheck(s);
+  if (SMTTimeout) s.set_timeout(SMTTimeout);
+  PhaseTimer solveTimer(stats_.solveTime);
+  SmtResult result = s.check();
+  solveTimer.stop();
+  stats_.solverCalls = s.solver_calls();
+  assert(result != SmtUnsat);
+  if (result == SmtUnknown) {
+    remark(&func_.getEntryBlock(),
+           "SMT solver found no solution within " + Twine(SMTTimeout) +
+           "ms; falling back to the greedy algorithm");
+    return false;
+  }
+  optimal = s.lower() == s.upper();
+  stats_.cost = s.upper();
+  stats_.optimal = optimal;
+  if (!optimal) {
+    remark(&func_.getEntryBlock(),
+           "SMT solver ran out of time; the cuts cost " + Twine(s.upper()) +
+           ", which may be up to " + Twine(s.upper() - s.lower()) +
+           " more than optimal");
+  }
+  if (UseMaxSAT && debugSpew) {
+    errs() << "MaxSAT cost bounds: " << s.lower() << " <= cost <= "
+           << s.upper() << "\n";
+  }
   SmtModel model = s.get_model();
 
   // Print out the results for debugging
   if (debugSpew) dumpModel(model);
 
-  std::vector<EdgeCut> cuts;
-
   // Find all edge cuts to insert
   for (auto & cuttype : cuttypes) {
     processMap<EdgeKey>(cuttype.map, model, [&] (EdgeKey &edge) {
@@ -1068,26 +1502,38 @@ std::vector<EdgeCut> RealizeRMC::smtAnalyzeInner() {
 
   if (debugSpew) errs() << "\n";
 
-  return cuts;
+  return true;
 }
 
-std::vector<EdgeCut> RealizeRMC::smtAnalyze() {
-  try {
-    return smtAnalyzeInner();
-  } catch (z3::exception &e) {
-    errs() << "Unexpected Z3 error: " << e.msg() << "\n";
-    std::terminate();
-  }
+void describeParams(raw_ostream &os, const TuningParams &p) {
+  os << "params " << p.syncCost << " " << p.lwsyncCost << " "
+     << p.dmbstCost << " " << p.dmbldCost << " " << p.isyncCost << " "
+     << p.useCtrlCost << " " << p.addCtrlCost << " " << p.useDataCost << " "
+     << p.makeReleaseCost << " " << p.makeAcquireCost << " "
+     << p.relAbuse << "\n";
 }
 
-
-#else /* !USE_Z3 */
-#include <exception>
-using namespace llvm;
-std::vector<EdgeCut> RealizeRMC::smtAnalyzeInner() {
-  std::terminate();
-}
-std::vector<EdgeCut> RealizeRMC::smtAnalyze() {
-  std::terminate();
+bool RealizeRMC::smtAnalyze(std::vector<EdgeCut> &cuts) {
+  bool optimal;
+  if (!solutions_) return smtAnalyzeInner(cuts, optimal);
+
+  // The answer depends on the problem but also on how we were told
+  // to solve it (ties can get broken differently).
+  FuncNumbering num(func_);
+  std::string description;
+  raw_string_ostream os(description);
+  describeProblem(os, num);
+  describeParams(os, archParams(target_));
+  os << "maxsat " << UseMaxSAT << " backend " << smtBackend() << "\n";
+  os.flush();
+
+  if (solutions_->lookup(description, num, pc_, cuts)) {
+    stats_.cached = true;
+    return true;
+  }
+  if (!smtAnalyzeInner(cuts, optimal)) return false;
+  // Don't keep an answer that we settled for; next time there might
+  // be more time.
+  if (optimal) solutions_->store(description, num, pc_, cuts);
+  return true;
 }
-#endif
@@ -0,0 +1,36 @@
+// Copyright (c) 2014-2017 Michael J. Sullivan
+// Use of this source code is governed by an MIT-style license that can be
+// found in the LICENSE file.
+
+// Timing the phases of the pass. Each phase adds its time to a total
+// in the function's RMCStats, which -rmc-stats-json and
+// -rmc-time-report print.
+
+#ifndef RMC_TIMING_H
+#define RMC_TIMING_H
+
+#include <chrono>
+
+// Adds the time from when it is made until stop() (or until it goes
+// away) to a total, in seconds.
+class PhaseTimer {
+public:
+  explicit PhaseTimer(double &total)
+    : total_(&total), start_(Clock::now()) {}
+  ~PhaseTimer() { stop(); }
+  PhaseTimer(const PhaseTimer &) = delete;
+  void operator=(const PhaseTimer &) = delete;
+
+  void stop() {
+    if (!total_) return;
+    *total_ += std::chrono::duration<double>(Clock::now() - start_).count();
+    total_ = nullptr;
+  }
+
+private:
+  typedef std::chrono::steady_clock Clock;
+  double *total_;
+  Clock::time_point start_;
+};
+
+#endif
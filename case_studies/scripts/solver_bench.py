@@ -0,0 +1,53 @@
+#!/usr/bin/env python3
+
+# Compare how long the SMT backend takes to compile the case studies
+# using Z3 and using the built-in solver. Also notes whether the two
+# produced the same object file (they can differ while both being
+# optimal, if there are ties).
+
+import sys, subprocess, time, filecmp, shutil
+
+SOLVERS = [('z3', '--cleanup'), ('builtin', '--cleanup --builtin-smt')]
+
+TESTS = [
+    ('epoch', 'epoch_rmc.o'),
+    ('ms_queue epoch', 'ms_queue-ec11-rmc-test.o'),
+    ('ms_queue freelist', 'ms_queue-fc11-rmc2-test.o'),
+    ('tstack epoch', 'tstack-ec11-rmc-test.o'),
+    ('tstack freelist', 'tstack-fc11-rmc2-test.o'),
+    ('rculist', 'rculist_user-ec11-rmc-test.o'),
+    ('ringbuf', 'ringbuf-rmc-test.o'),
+    ('qspinlock', 'seqlock-lock-rmc-test.o'),
+    ('seqlock', 'seqlock-rmc-test.o'),
+]
+
+
+def main(argv):
+    out = open('data/solver_speed.csv', 'a')
+    for (name, obj) in TESTS:
+        real_obj = 'build/' + obj
+        times = []
+        for (solver, flags) in SOLVERS:
+            subprocess.call(["rm", "-f", real_obj])
+            # Find the command first, so we don't time make.
+            cmd = subprocess.run(['make', 'VERBOSE=1', '-n', real_obj,
+                                  'RMC_CONFIG_FLAGS=' + flags],
+                                 check=True,
+                                 universal_newlines=True,
+                                 stdout=subprocess.PIPE).stdout.strip()
+            start = time.time()
+            subprocess.call(cmd, shell=True)
+            end = time.time()
+            times += [end-start]
+            shutil.copy(real_obj, real_obj + '.' + solver)
+        same = filecmp.cmp(real_obj + '.z3', real_obj + '.builtin',
+                           shallow=False)
+        row = [name] + [str(t) for t in times] + [str(int(same))]
+        print(",".join(row), file=out)
+        print("%s: z3 %.2fs, builtin %.2fs%s" %
+              (name, times[0], times[1], "" if same else " (output differs)"))
+    out.close()
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv))
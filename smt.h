@@ -1,54 +1,311 @@
 #ifndef RMC_SMT_H
 #define RMC_SMT_H
 
-// Some amount of generic machinery around Z3. A relic from when Z3
-// wasn't free software and I wanted to support something else as
-// well.
+// Some amount of generic machinery around SMT solving. This used to
+// just be a thin set of typedefs over Z3 (a relic from when Z3 wasn't
+// free software and I wanted to support something else as well); now
+// we build formulas in a little expression store of our own and then
+// hand them off to a backend: Z3, or a small built-in pseudo-Boolean
+// optimizer for when Z3 isn't available or is too slow.
+//
+// The operations mimic the parts of the z3++ API that we used, so
+// that the code building formulas didn't need to change much.
+//
+// The problems we generate are all boolean except for the thing being
+// minimized, which is a sum of ite(b, w, 0) terms, and that is all
+// that the built-in backend supports: integer terms must be linear
+// sums of constants and ite()s of constants, and an integer constant
+// can only be used after it has been asserted equal to such a sum.
 
-#include <z3++.h>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+#include <assert.h>
 
-typedef __uint64 smt_uint;
+typedef uint64_t smt_uint;
 
-#if USE_Z3_OPTIMIZER
-typedef z3::optimize SmtSolver;
-#else
-typedef z3::solver SmtSolver;
+enum SmtOp : uint8_t {
+  SmtBoolVal,
+  SmtIntVal,
+  SmtVar,
+  SmtNot,
+  SmtAnd,
+  SmtOr,
+  SmtEq,
+  SmtIte,
+  SmtAdd,
+  SmtMul,
+  SmtLe,
+  SmtLt,
+};
+
+struct SmtNode {
+  SmtOp op;
+  bool isBool;
+  unsigned args[3];
+  // The value of a constant, or the index of a variable
+  int64_t val;
+};
+
+class SmtExpr;
+class SmtSort;
+
+// Owns all of the expressions. Expressions are never freed before the
+// context is; they are just indexes into it.
+class SmtContext {
+public:
+  SmtContext();
+  SmtContext(const SmtContext &) = delete;
+  void operator=(const SmtContext &) = delete;
+
+  SmtSort bool_sort();
+  SmtSort int_sort();
+  SmtExpr bool_val(bool b);
+  SmtExpr int_val(int64_t i);
+  SmtExpr constant(const char *name, const SmtSort &sort);
+  SmtExpr bool_const(const char *name);
+  SmtExpr int_const(const char *name);
+  // A variable named prefix!n, where n is its index. The name only
+  // gets put together if somebody asks for it.
+  SmtExpr fresh_constant(const char *prefix, const SmtSort &sort);
+
+  unsigned make(SmtOp op, bool isBool,
+                unsigned a = 0, unsigned b = 0, unsigned c = 0,
+                int64_t val = 0);
+  const SmtNode &node(unsigned id) const { return nodes_[id]; }
+  unsigned numNodes() const { return nodes_.size(); }
+
+  unsigned numVars() const { return vars_.size(); }
+  unsigned varNode(unsigned var) const { return vars_[var]; }
+  std::string varName(unsigned var) const;
+  bool isFresh(unsigned var) const { return fresh_[var]; }
+
+  // The ids of the two boolean constants
+  enum { kFalse = 0, kTrue = 1 };
+
+private:
+  std::vector<SmtNode> nodes_;
+  std::vector<unsigned> vars_;
+  // The names, or the prefixes for fresh ones
+  std::vector<std::string> names_;
+  std::vector<bool> fresh_;
+
+  // Everything but variables gets hash-consed, since the same
+  // subformulas get built over and over (once per path, say).
+  typedef std::tuple<int, unsigned, unsigned, unsigned, int64_t> NodeKey;
+  struct NodeKeyHash {
+    size_t operator()(const NodeKey &k) const {
+      size_t h = std::get<0>(k);
+      h = h * 31 + std::get<1>(k);
+      h = h * 31 + std::get<2>(k);
+      h = h * 31 + std::get<3>(k);
+      return h * 31 + std::hash<int64_t>()(std::get<4>(k));
+    }
+  };
+  std::unordered_map<NodeKey, unsigned, NodeKeyHash> uniq_;
+};
+
+class SmtSort {
+public:
+  SmtSort(SmtContext &c, bool isBool) : c_(&c), isBool_(isBool) {}
+  SmtContext &ctx() const { return *c_; }
+  bool is_bool() const { return isBool_; }
+private:
+  SmtContext *c_;
+  bool isBool_;
+};
+
+class SmtExpr {
+public:
+  SmtExpr() : c_(nullptr), id_(0) {}
+  SmtExpr(SmtContext &c, unsigned id) : c_(&c), id_(id) {}
+
+  SmtContext &ctx() const { return *c_; }
+  unsigned id() const { return id_; }
+  const SmtNode &node() const { return c_->node(id_); }
+  bool is_bool() const { return node().isBool; }
+  bool isBoolVal(bool b) const {
+    return node().op == SmtBoolVal && node().val == b;
+  }
+  bool isIntVal() const { return node().op == SmtIntVal; }
+
+  // Constants get folded as expressions are built, so there is
+  // nothing left to do here.
+  SmtExpr simplify() const { return *this; }
+
+private:
+  SmtContext *c_;
+  unsigned id_;
+};
+
+SmtExpr operator!(const SmtExpr &a);
+SmtExpr operator&&(const SmtExpr &a, const SmtExpr &b);
+SmtExpr operator||(const SmtExpr &a, const SmtExpr &b);
+SmtExpr operator==(const SmtExpr &a, const SmtExpr &b);
+SmtExpr operator+(const SmtExpr &a, const SmtExpr &b);
+SmtExpr operator*(const SmtExpr &a, const SmtExpr &b);
+SmtExpr operator<=(const SmtExpr &a, const SmtExpr &b);
+SmtExpr operator<(const SmtExpr &a, const SmtExpr &b);
+inline SmtExpr operator>=(const SmtExpr &a, const SmtExpr &b) {
+  return b <= a;
+}
+inline SmtExpr operator>(const SmtExpr &a, const SmtExpr &b) {
+  return b < a;
+}
+SmtExpr implies(const SmtExpr &a, const SmtExpr &b);
+SmtExpr ite(const SmtExpr &c, const SmtExpr &a, const SmtExpr &b);
+std::ostream &operator<<(std::ostream &os, const SmtExpr &e);
+
+// An assignment to the variables of a context. Variables that the
+// backend never saw are false/zero.
+class SmtModel {
+public:
+  SmtModel(SmtContext &c, std::vector<int64_t> vals)
+    : c_(&c), vals_(std::move(vals)) {}
+  // Returns a constant
+  SmtExpr eval(const SmtExpr &e) const;
+  int64_t value(const SmtExpr &e) const;
+  int64_t varValue(unsigned var) const {
+    return var < vals_.size() ? vals_[var] : 0;
+  }
+  void print(std::ostream &os) const;
+private:
+  SmtContext *c_;
+  std::vector<int64_t> vals_;
+};
+
+enum SmtResult {
+  SmtUnsat,
+  SmtSat,
+  SmtUnknown,
+};
+
+enum SmtBackend {
+  SmtBackendBuiltin,
+  SmtBackendZ3,
+};
+
+class SmtSolverImpl {
+public:
+  virtual ~SmtSolverImpl() {}
+  virtual void add(const SmtExpr &e) = 0;
+  virtual void push() = 0;
+  virtual void pop() = 0;
+  virtual void minimize(const SmtExpr &e) = 0;
+  virtual void add_soft(const SmtExpr &e, smt_uint weight) = 0;
+  virtual void set_timeout(unsigned ms) = 0;
+  virtual void set_initial_value(const SmtExpr &var, bool value) = 0;
+  virtual SmtResult check() = 0;
+  virtual SmtModel get_model() = 0;
+  virtual smt_uint lower() = 0;
+  virtual smt_uint upper() = 0;
+  virtual unsigned solver_calls() = 0;
+  virtual void print(std::ostream &os) = 0;
+};
+
+std::unique_ptr<SmtSolverImpl> makeBuiltinSolver(SmtContext &c);
+std::unique_ptr<SmtSolverImpl> makeSplittingSolver(SmtContext &c,
+                                                   SmtBackend backend,
+                                                   unsigned threads);
+#if USE_Z3
+std::unique_ptr<SmtSolverImpl> makeZ3Solver(SmtContext &c);
 #endif
-typedef z3::expr SmtExpr;
-typedef z3::context SmtContext;
-typedef z3::sort SmtSort;
-typedef z3::model SmtModel;
+
+class SmtSolver {
+public:
+  // If splitThreads isn't zero, the problem gets split into parts
+  // that don't share any variables, which are solved separately,
+  // that many at a time.
+  SmtSolver(SmtContext &c, SmtBackend backend, unsigned splitThreads = 0)
+    : c_(c) {
+    if (splitThreads) {
+      impl_ = makeSplittingSolver(c, backend, splitThreads);
+      return;
+    }
+#if USE_Z3
+    if (backend == SmtBackendZ3) {
+      impl_ = makeZ3Solver(c);
+      return;
+    }
+#endif
+    impl_ = makeBuiltinSolver(c);
+  }
+
+  SmtContext &ctx() { return c_; }
+  void add(const SmtExpr &e) { impl_->add(e); ++assertions_; }
+  void push() { impl_->push(); }
+  void pop() { impl_->pop(); }
+  // Ask for a model that minimizes e. If this gets called more than
+  // once, the sum is minimized.
+  void minimize(const SmtExpr &e) { impl_->minimize(e); }
+  // A soft constraint: e should hold, but the only penalty for it
+  // not holding is weight, which goes into the minimized cost.
+  void add_soft(const SmtExpr &e, smt_uint weight) {
+    impl_->add_soft(e, weight);
+  }
+  // Make check() give up after about ms milliseconds (0 means never).
+  // If it has found a model by then, it returns SmtSat with the best
+  // one so far, and lower() and upper() say how far from optimal it
+  // might be; if not, it returns SmtUnknown.
+  void set_timeout(unsigned ms) { impl_->set_timeout(ms); }
+  // Suggest a value for a boolean variable. If there is a model that
+  // agrees with all of the suggestions, check() starts from it, so
+  // its cost bounds the search right away.
+  void set_initial_value(const SmtExpr &e, bool value) {
+    if (e.node().op == SmtNot) {
+      set_initial_value(SmtExpr(c_, e.node().args[0]), !value);
+    } else if (e.node().op == SmtVar) {
+      impl_->set_initial_value(e, value);
+    }
+  }
+  SmtResult check() { return impl_->check(); }
+  SmtModel get_model() { return impl_->get_model(); }
+  // Bounds on the optimal cost that the last check() proved. upper()
+  // is the cost of the model.
+  smt_uint lower() { return impl_->lower(); }
+  smt_uint upper() { return impl_->upper(); }
+  // How many times check() has had to run the underlying solver,
+  // which can be more than once when it searches for the minimum by
+  // hand.
+  unsigned solver_calls() { return impl_->solver_calls(); }
+  // How many things have been add()ed, pops or no
+  unsigned num_assertions() const { return assertions_; }
+  void print(std::ostream &os) { impl_->print(os); }
+
+private:
+  SmtContext &c_;
+  unsigned assertions_{0};
+  std::unique_ptr<SmtSolverImpl> impl_;
+};
 
 static bool extractBool(SmtExpr const &e) {
-  auto b = Z3_get_bool_value(e.ctx(), e);
-  assert(b != Z3_L_UNDEF);
-  return b == Z3_L_TRUE;
+  assert(e.node().op == SmtBoolVal);
+  return e.node().val != 0;
 }
 static int extractInt(SmtExpr const &e) {
-  int i;
-  auto b = Z3_get_numeral_int(e.ctx(), e, &i);
-  assert_(b == Z3_TRUE);
-  return i;
+  assert(e.node().op == SmtIntVal);
+  return (int)e.node().val;
 }
 
 static void dumpSolver(SmtSolver &solver) {
-  std::cout << "Built a thing: \n" << solver << "\n\n";
+  std::cout << "Built a thing: \n";
+  solver.print(std::cout);
+  std::cout << "\n\n";
 }
 
 static void dumpModel(SmtModel &model) {
-  // traversing the model
-  for (unsigned i = 0; i < model.size(); ++i) {
-    z3::func_decl v = model[i];
-    // this problem contains only constants
-    assert(v.arity() == 0);
-    std::cout << v.name() << " = " << model.get_const_interp(v) << "\n";
-  }
+  model.print(std::cout);
 }
 
 static bool doCheck(SmtSolver &s) {
-  z3::check_result result = s.check();
-  assert(result != z3::unknown);
-  return result == z3::sat;
+  SmtResult result = s.check();
+  assert(result != SmtUnknown);
+  return result == SmtSat;
 }
 
 #endif